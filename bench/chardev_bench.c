@@ -0,0 +1,417 @@
+/* End-to-end throughput and latency of /dev/mailslot*.
+ *
+ * For every message size and producer count, forks that many producer
+ * and the given number of consumer processes on each of the first M
+ * minors. Producers write() messages carrying a CLOCK_MONOTONIC
+ * timestamp, consumers read() them back and sample the enqueue to dequeue
+ * latency. Needs the module loaded and one device node per minor (see
+ * bench/mknod.sh).
+ *
+ *   bench/chardev_bench [-d /dev/mailslot%u] [-M mode] [-m minors]
+ *                       [-p 1,2,4,...] [-c consumers] [-n messages]
+ *                       [-s 16,64,...] [-x]
+ *
+ * Counts are per minor; -n is per producer. Producer i is pinned to CPU
+ * i, so a producer list from 1 to the number of CPUs measures write
+ * scaling across cores. -M sets the MAILSLOT_MODE_* of the minors first;
+ * the descriptor that set it stays open for the whole run, otherwise the
+ * instance would be freed and reopened in locked mode. Rows are labelled
+ * with it, so "make bench-spsc" gives the latency percentiles of the SPSC
+ * fast path next to the locked engine's.
+ *
+ * -x moves both sides to the mmap'd ring (libmailslot's
+ * mailslot_ring_push/pop). Each side of a ring is driven by one process,
+ * so it takes one producer and one consumer per minor. Compare against
+ * the same run without -x ("make bench-mmap").
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mailslot.h"
+#include "lib/libmailslot.h"
+
+#define MAX_LIST 1024		// -p 1,2,...,$(nproc) on large machines
+#define MAX_SIZE 65536
+#define SAMPLES 65536		// Latency samples kept per consumer
+#define SAMPLE_EVERY 8
+
+// Shared between the processes of a run, one per minor
+struct minor_state
+{
+	unsigned long total;	// Messages the producers will write
+	unsigned long popped;	// Messages read so far
+	int aborted;		// A producer failed, stop waiting for its messages
+};
+
+struct consumer_state
+{
+	unsigned int nr_samples;
+	uint64_t samples[SAMPLES];
+};
+
+static const char *dev_pattern = "/dev/mailslot%u";
+static int use_mmap;		// Through the mapped ring instead of read()/write()
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int openMinor(unsigned int minor, int flags)
+{
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), dev_pattern, minor);
+	fd = open(path, flags);
+	if (fd < 0)
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+	return fd;
+}
+
+// Keep the instance of a minor alive for the whole run. O_ACCMODE (access
+// mode 3) is the ioctl-only open: neither a reader nor a writer, so it
+// leaves the SPSC fast paths on.
+static int holdMinor(unsigned int minor)
+{
+	return openMinor(minor, O_ACCMODE);
+}
+
+// Switch the engine of a minor through its holding descriptor
+static int setMode(int fd, unsigned int minor, int mode)
+{
+	if (ioctl(fd, MAILSLOT_IOC_SET_MODE, mode) < 0)
+	{
+		fprintf(stderr, "minor %u: mode %d: %s\n", minor, mode, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+// Row label of a MAILSLOT_MODE_*, "-" when left as is
+static const char *modeName(int mode)
+{
+	static const char *names[] = { "locked", "spsc", "bcast", "bdrop", "staged", "mpmc" };
+
+	return mode >= 0 && mode < (int)(sizeof(names) / sizeof(names[0])) ? names[mode] : "-";
+}
+
+// Drop whatever a previous run left queued
+static void drain(unsigned int minor)
+{
+	char buf[MAX_SIZE + 1];
+	int fd = openMinor(minor, O_RDONLY | O_NONBLOCK);
+
+	if (fd < 0)
+		return;
+	while (read(fd, buf, sizeof(buf)) >= 0)
+		;
+	close(fd);
+}
+
+// Map the ring of "fd" when running with -x. The mapping is shared and
+// writable, so both sides open the minor O_RDWR then.
+static int mapMinor(int fd, struct mailslot_ring *ring)
+{
+	int err;
+
+	if (!use_mmap)
+		return 0;
+	err = mailslot_ring_map(ring, fd);
+	if (err)
+		fprintf(stderr, "mmap: %s\n", strerror(-err));
+	return err;
+}
+
+// One message in, 0 or -errno. The ring push sleeps when full like write().
+static int sendOne(int fd, struct mailslot_ring *ring, const char *buf, size_t size)
+{
+	if (use_mmap)
+		return mailslot_ring_push_wait(ring, buf, size);
+	return write(fd, buf, size) < 0 ? -errno : 0;
+}
+
+// One message out, 0 or -errno (-EAGAIN when empty)
+static int receiveOne(int fd, struct mailslot_ring *ring, char *buf, size_t size)
+{
+	ssize_t ret = use_mmap ? mailslot_ring_pop(ring, buf, size) : read(fd, buf, size);
+
+	if (!use_mmap && ret < 0)
+		ret = -errno;
+	return ret < 0 ? ret : 0;
+}
+
+static int produce(unsigned int minor, struct minor_state *ms, unsigned int cpu, size_t size, unsigned long messages)
+{
+	char buf[MAX_SIZE] = { 0 };
+	int fd = openMinor(minor, use_mmap ? O_RDWR : O_WRONLY);
+	struct mailslot_ring ring;
+	unsigned long i;
+	cpu_set_t set;
+	int err;
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu % sysconf(_SC_NPROCESSORS_ONLN), &set);
+	sched_setaffinity(0, sizeof(set), &set);
+
+	if (fd < 0 || mapMinor(fd, &ring))
+	{
+		__atomic_store_n(&ms->aborted, 1, __ATOMIC_RELAXED);
+		return 1;
+	}
+
+	for (i = 0; i < messages; i++)
+	{
+		uint64_t t = nowNs();
+
+		memcpy(buf, &t, sizeof(t));
+		err = sendOne(fd, &ring, buf, size);
+		if (err == -EINTR)
+		{
+			i--;
+			continue;
+		}
+		if (err)
+		{
+			fprintf(stderr, "write %zu bytes: %s\n", size, strerror(-err));
+			__atomic_store_n(&ms->aborted, 1, __ATOMIC_RELAXED);
+			return 1;
+		}
+	}
+	if (use_mmap)
+		mailslot_ring_unmap(&ring);
+	close(fd);
+	return 0;
+}
+
+// Read until the producers of the minor are done. Non-blocking reads
+// after poll(), so a consumer never sleeps on a message another one took.
+static int consume(unsigned int minor, struct minor_state *ms, struct consumer_state *cs)
+{
+	char buf[MAX_SIZE + 1];		// read() appends a newline
+	int fd = openMinor(minor, (use_mmap ? O_RDWR : O_RDONLY) | O_NONBLOCK);
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	struct mailslot_ring ring;
+	unsigned long n = 0;
+	int err;
+
+	if (fd < 0 || mapMinor(fd, &ring))
+		return 1;
+
+	while (__atomic_load_n(&ms->popped, __ATOMIC_RELAXED) < ms->total &&
+	       !__atomic_load_n(&ms->aborted, __ATOMIC_RELAXED))
+	{
+		uint64_t t;
+
+		err = receiveOne(fd, &ring, buf, sizeof(buf));
+		if (err)
+		{
+			if (err != -EAGAIN && err != -EINTR)
+			{
+				fprintf(stderr, "read: %s\n", strerror(-err));
+				return 1;
+			}
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		__atomic_fetch_add(&ms->popped, 1, __ATOMIC_RELAXED);
+
+		if (n++ % SAMPLE_EVERY == 0 && cs->nr_samples < SAMPLES)
+		{
+			memcpy(&t, buf, sizeof(t));
+			cs->samples[cs->nr_samples++] = nowNs() - t;
+		}
+	}
+	if (use_mmap)
+		mailslot_ring_unmap(&ring);
+	close(fd);
+	return 0;
+}
+
+static int cmpU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Parse a comma separated list of positive numbers, returns their count
+static int parseList(const char *arg, unsigned long *out)
+{
+	char *copy = strdup(arg), *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &save))
+		if ((out[n] = strtoul(tok, NULL, 0)) > 0)
+			n++;
+	if (tok)
+		fprintf(stderr, "Only the first %d entries of \"%s\" are used\n", MAX_LIST, arg);
+	free(copy);
+	return n;
+}
+
+static int runOne(int mode, size_t size, unsigned int minors, unsigned int producers, unsigned int consumers, unsigned long messages)
+{
+	size_t shared_size = minors * sizeof(struct minor_state) +
+			     minors * consumers * sizeof(struct consumer_state);
+	struct minor_state *ms;
+	struct consumer_state *cs;
+	unsigned long total = (unsigned long)minors * producers * messages;
+	uint64_t start, elapsed, *all;
+	unsigned int m, i, n = 0;
+	int status, failed = 0;
+
+	ms = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ms == MAP_FAILED)
+		return -1;
+	cs = (struct consumer_state *)(ms + minors);
+
+	for (m = 0; m < minors; m++)
+	{
+		drain(m);
+		ms[m].total = (unsigned long)producers * messages;
+	}
+
+	// Consumers first, so producers never wait for a reader to show up
+	start = nowNs();
+	for (m = 0; m < minors; m++)
+	{
+		for (i = 0; i < consumers; i++)
+			if (fork() == 0)
+				_exit(consume(m, &ms[m], &cs[m * consumers + i]));
+		for (i = 0; i < producers; i++)
+			if (fork() == 0)
+				_exit(produce(m, &ms[m], i, size, messages));
+	}
+	while (wait(&status) > 0)
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			failed = 1;
+	elapsed = nowNs() - start;
+
+	if (failed)
+	{
+		fprintf(stderr, "size %zu: a producer or consumer failed\n", size);
+		munmap(ms, shared_size);
+		return -1;
+	}
+
+	all = malloc((size_t)minors * consumers * SAMPLES * sizeof(*all));
+	for (i = 0; i < minors * consumers; i++)
+	{
+		memcpy(all + n, cs[i].samples, cs[i].nr_samples * sizeof(*all));
+		n += cs[i].nr_samples;
+	}
+	qsort(all, n, sizeof(*all), cmpU64);
+
+	printf("%6s %8zu %6u %4u %4u %4s %12.0f %10.1f %10llu %10llu %10llu\n",
+	       modeName(mode), size, minors, producers, consumers, use_mmap ? "mmap" : "rw",
+	       total * 1e9 / elapsed, total * size * 1e3 / elapsed,
+	       n ? (unsigned long long)all[n / 2] : 0ULL,
+	       n ? (unsigned long long)all[n * 99 / 100] : 0ULL,
+	       n ? (unsigned long long)all[n * 999 / 1000] : 0ULL);
+
+	free(all);
+	munmap(ms, shared_size);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long sizes[MAX_LIST] = { 16, 64, 256 };
+	unsigned long producers[MAX_LIST] = { 1 };
+	int nr_sizes = 3, nr_producers = 1;
+	unsigned int minors = 1, consumers = 1, m;
+	unsigned long messages = 100000;
+	int mode = -1, *held;
+	int opt, i, j;
+
+	while ((opt = getopt(argc, argv, "d:M:m:p:c:n:s:x")) != -1)
+	{
+		switch (opt)
+		{
+		case 'd':
+			dev_pattern = optarg;
+			break;
+		case 'M':
+			mode = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			minors = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			nr_producers = parseList(optarg, producers);
+			break;
+		case 'c':
+			consumers = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			messages = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			nr_sizes = parseList(optarg, sizes);
+			break;
+		case 'x':
+			use_mmap = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-d /dev/mailslot%%u] [-M mode] [-m minors] [-p producers] [-c consumers] [-n messages] [-s sizes] [-x]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (minors == 0 || nr_producers == 0 || consumers == 0)
+	{
+		fprintf(stderr, "minors, producers and consumers must be at least 1\n");
+		return 1;
+	}
+	for (j = 0; use_mmap && j < nr_producers; j++)
+	{
+		if (producers[j] > 1 || consumers > 1)
+		{
+			fprintf(stderr, "-x takes one producer and one consumer per minor\n");
+			return 1;
+		}
+	}
+
+	// Closed at exit
+	held = calloc(minors, sizeof(*held));
+	if (!held)
+		return 1;
+	for (m = 0; m < minors; m++)
+	{
+		held[m] = holdMinor(m);
+		if (held[m] < 0 || (mode >= 0 && setMode(held[m], m, mode)))
+			return 1;
+	}
+
+	printf("%6s %8s %6s %4s %4s %4s %12s %10s %10s %10s %10s\n",
+	       "mode", "size", "minors", "prod", "cons", "io", "msgs/s", "MB/s", "p50_ns", "p99_ns", "p999_ns");
+	fflush(stdout);	// Before forking
+	for (i = 0; i < nr_sizes; i++)
+	{
+		// Room for the timestamp
+		size_t size = sizes[i] < sizeof(uint64_t) ? sizeof(uint64_t) : sizes[i];
+
+		if (size > MAX_SIZE)
+			size = MAX_SIZE;
+		for (j = 0; j < nr_producers; j++)
+			if (runOne(mode, size, minors, producers[j], consumers, messages))
+				return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,9 @@
+# Create /dev/mailslot0 .. /dev/mailslot<N-1> for the loaded module
+N=${1:-4}
+MAJOR=$(awk '$2 == "mailslot" { print $1 }' /proc/devices)
+for i in $(seq 0 $((N - 1)))
+do
+	rm -f /dev/mailslot$i
+	mknod /dev/mailslot$i c $MAJOR $i
+	chmod 666 /dev/mailslot$i
+done
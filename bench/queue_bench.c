@@ -0,0 +1,356 @@
+/* Throughput and latency of the mailslot queue engine, in user space.
+ *
+ * Runs the driver's locked push/pop (lib/libmailslot_queue.a) with N
+ * producer and N consumer threads for every message size and thread count
+ * given, no module needed. Messages above the inline size (-i, the
+ * module's default otherwise) go out of line as in the driver. Latency is
+ * enqueue to dequeue, sampled from a timestamp carried in each message.
+ *
+ * -L runs the queue the driver used before the ring instead, as a
+ * baseline: a linked list under one mutex, two allocations per message
+ * (the node and a block of the maximum message size), bounded to as many
+ * messages as the ring would hold.
+ *
+ *   bench/queue_bench [-n messages] [-r ring_size] [-i inline_size]
+ *                     [-s 16,64,...] [-t 1,2,...] [-L]
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mailslot.h"
+#include "lib/mailslot_queue.h"
+
+#define MAX_LIST 16
+#define MAX_SIZE 65536
+#define SAMPLES 65536		// Latency samples kept per consumer
+#define SAMPLE_EVERY 16
+
+// Baseline queue, see -L
+struct list_message
+{
+	char *content;
+	size_t len;
+	struct list_message *next;
+};
+
+struct list_queue
+{
+	pthread_mutex_t mutex;
+	struct list_message *head;	// FIFO head
+	struct list_message *tail;	// FIFO tail
+	unsigned long count;
+	unsigned long capacity;
+	size_t msg_size;		// Of every content block
+};
+
+struct run
+{
+	struct mailslot_queue *q;
+	struct list_queue *list;	// Instead of "q" with -L
+	size_t size;
+	unsigned long per_producer;
+	unsigned long total;
+	unsigned long popped;		// Shared by the consumers
+};
+
+struct consumer
+{
+	pthread_t thread;
+	struct run *run;
+	uint64_t samples[SAMPLES];
+	unsigned int nr_samples;
+};
+
+static uint64_t nowNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static struct list_queue *listCreate(unsigned long capacity, size_t msg_size)
+{
+	struct list_queue *l = calloc(1, sizeof(*l));
+
+	if (!l)
+		return NULL;
+	pthread_mutex_init(&l->mutex, NULL);
+	l->capacity = capacity;
+	l->msg_size = msg_size;
+	return l;
+}
+
+static void listDestroy(struct list_queue *l)
+{
+	struct list_message *msg;
+
+	while ((msg = l->head))
+	{
+		l->head = msg->next;
+		free(msg->content);
+		free(msg);
+	}
+	pthread_mutex_destroy(&l->mutex);
+	free(l);
+}
+
+// Same contract as mailslot_queue_push()
+static int listPush(struct list_queue *l, const void *buf, size_t len)
+{
+	struct list_message *msg;
+
+	if (len > l->msg_size)
+		return -EMSGSIZE;
+
+	pthread_mutex_lock(&l->mutex);
+	if (l->count == l->capacity)
+	{
+		pthread_mutex_unlock(&l->mutex);
+		return -EAGAIN;
+	}
+
+	// Allocated under the lock, as the driver did
+	msg = malloc(sizeof(*msg));
+	if (msg && !(msg->content = malloc(l->msg_size)))
+	{
+		free(msg);
+		msg = NULL;
+	}
+	if (!msg)
+	{
+		pthread_mutex_unlock(&l->mutex);
+		return -ENOMEM;
+	}
+	memcpy(msg->content, buf, len);
+	msg->len = len;
+	msg->next = NULL;
+
+	if (l->tail)
+		l->tail->next = msg;
+	else
+		l->head = msg;
+	l->tail = msg;
+	l->count++;
+	pthread_mutex_unlock(&l->mutex);
+	return 0;
+}
+
+// Same contract as mailslot_queue_pop()
+static ssize_t listPop(struct list_queue *l, void *buf, size_t len)
+{
+	struct list_message *msg;
+	ssize_t ret;
+
+	pthread_mutex_lock(&l->mutex);
+	msg = l->head;
+	if (!msg || msg->len > len)
+	{
+		pthread_mutex_unlock(&l->mutex);
+		return msg ? -EMSGSIZE : -EAGAIN;
+	}
+	memcpy(buf, msg->content, msg->len);
+	ret = msg->len;
+
+	l->head = msg->next;
+	if (!l->head)
+		l->tail = NULL;
+	l->count--;
+	free(msg->content);
+	free(msg);
+	pthread_mutex_unlock(&l->mutex);
+	return ret;
+}
+
+static int queuePush(struct run *run, const void *buf, size_t len)
+{
+	return run->list ? listPush(run->list, buf, len) : mailslot_queue_push(run->q, buf, len);
+}
+
+static ssize_t queuePop(struct run *run, void *buf, size_t len)
+{
+	return run->list ? listPop(run->list, buf, len) : mailslot_queue_pop(run->q, buf, len);
+}
+
+static void *produce(void *arg)
+{
+	struct run *run = arg;
+	char buf[MAX_SIZE] = { 0 };
+	unsigned long i;
+
+	for (i = 0; i < run->per_producer; i++)
+	{
+		uint64_t t = nowNs();
+
+		memcpy(buf, &t, sizeof(t));
+		while (queuePush(run, buf, run->size) == -EAGAIN)
+			sched_yield();
+	}
+	return NULL;
+}
+
+static void *consume(void *arg)
+{
+	struct consumer *c = arg;
+	struct run *run = c->run;
+	char buf[MAX_SIZE];
+	unsigned long n = 0;
+
+	while (__atomic_load_n(&run->popped, __ATOMIC_RELAXED) < run->total)
+	{
+		uint64_t t;
+
+		if (queuePop(run, buf, sizeof(buf)) < 0)
+		{
+			sched_yield();
+			continue;
+		}
+		__atomic_fetch_add(&run->popped, 1, __ATOMIC_RELAXED);
+
+		if (n++ % SAMPLE_EVERY == 0 && c->nr_samples < SAMPLES)
+		{
+			memcpy(&t, buf, sizeof(t));
+			c->samples[c->nr_samples++] = nowNs() - t;
+		}
+	}
+	return NULL;
+}
+
+static int cmpU64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+// Parse a comma separated list of positive numbers, returns their count
+static int parseList(const char *arg, unsigned long *out)
+{
+	char *copy = strdup(arg), *tok, *save;
+	int n = 0;
+
+	for (tok = strtok_r(copy, ",", &save); tok && n < MAX_LIST; tok = strtok_r(NULL, ",", &save))
+		if ((out[n] = strtoul(tok, NULL, 0)) > 0)
+			n++;
+	if (tok)
+		fprintf(stderr, "Only the first %d entries of \"%s\" are used\n", MAX_LIST, arg);
+	free(copy);
+	return n;
+}
+
+static int runOne(size_t size, unsigned int threads, unsigned long messages, unsigned int ring, unsigned int inline_max, int list)
+{
+	struct run run = { .size = size, .per_producer = messages / threads };
+	pthread_t producers[threads];
+	struct consumer *consumers = calloc(threads, sizeof(*consumers));
+	uint64_t *all, start, elapsed;
+	unsigned int i, n = 0;
+
+	run.total = run.per_producer * threads;
+	if (list)
+		run.list = listCreate(ring / MAILSLOT_RECORD_SIZE(size), size);
+	else
+		run.q = mailslot_queue_create(ring, size, inline_max, 0);
+	if (!(run.q || (run.list && run.list->capacity)) || !consumers)
+	{
+		fprintf(stderr, "size %zu does not fit a %u byte ring\n", size, ring);
+		if (run.list)
+			listDestroy(run.list);
+		free(consumers);
+		return -1;
+	}
+
+	start = nowNs();
+	for (i = 0; i < threads; i++)
+	{
+		consumers[i].run = &run;
+		pthread_create(&consumers[i].thread, NULL, consume, &consumers[i]);
+		pthread_create(&producers[i], NULL, produce, &run);
+	}
+	for (i = 0; i < threads; i++)
+	{
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i].thread, NULL);
+	}
+	elapsed = nowNs() - start;
+
+	all = malloc(threads * SAMPLES * sizeof(*all));
+	for (i = 0; i < threads; i++)
+	{
+		memcpy(all + n, consumers[i].samples, consumers[i].nr_samples * sizeof(*all));
+		n += consumers[i].nr_samples;
+	}
+	qsort(all, n, sizeof(*all), cmpU64);
+
+	printf("%5s %8zu %7u %12.0f %10.1f %10llu %10llu\n", list ? "list" : "ring", size, threads,
+	       run.total * 1e9 / elapsed, run.total * size * 1e3 / elapsed,
+	       n ? (unsigned long long)all[n / 2] : 0ULL,
+	       n ? (unsigned long long)all[n * 99 / 100] : 0ULL);
+
+	free(all);
+	free(consumers);
+	if (list)
+		listDestroy(run.list);
+	else
+		mailslot_queue_destroy(run.q);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long sizes[MAX_LIST] = { 16, 64, 256, 1024, 4096 };
+	unsigned long threads[MAX_LIST] = { 1, 2, 4 };
+	int nr_sizes = 5, nr_threads = 3;
+	unsigned long messages = 1000000;
+	unsigned int ring = 1 << 20, inline_max = 2048;
+	int list = 0, opt, i, j;
+
+	while ((opt = getopt(argc, argv, "n:r:i:s:t:L")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			messages = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			ring = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			inline_max = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			nr_sizes = parseList(optarg, sizes);
+			break;
+		case 't':
+			nr_threads = parseList(optarg, threads);
+			break;
+		case 'L':
+			list = 1;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-n messages] [-r ring_size] [-i inline_size] [-s sizes] [-t threads] [-L]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	printf("%5s %8s %7s %12s %10s %10s %10s\n", "queue", "size", "threads", "msgs/s", "MB/s", "p50_ns", "p99_ns");
+	for (i = 0; i < nr_sizes; i++)
+	{
+		// Room for the timestamp
+		size_t size = sizes[i] < sizeof(uint64_t) ? sizeof(uint64_t) : sizes[i];
+
+		if (size > MAX_SIZE)
+			size = MAX_SIZE;
+		for (j = 0; j < nr_threads; j++)
+			runOne(size, threads[j], messages, ring, inline_max, list);
+	}
+	return 0;
+}
@@ -0,0 +1,332 @@
+/* Kernel primitives used by the shared mailslot sources (mailslot_ring.c
+ * and the userspace queue), mapped onto libc and pthreads. Only what those
+ * sources use, with the kernel semantics they rely on. */
+
+#ifndef _KCOMPAT_H
+#define _KCOMPAT_H
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <linux/types.h>
+
+typedef __u32 u32;
+typedef __u64 u64;
+
+// Memory model, as the kernel macros on the targets we run on
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define WRITE_ONCE(x, v) __atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+#define smp_load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define smp_mb() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+
+#define pr_debug(fmt, ...) do { if (0) fprintf(stderr, fmt, ##__VA_ARGS__); } while (0)
+
+// Atomics
+typedef struct
+{
+	long counter;
+} atomic_long_t;
+
+#define atomic_long_set(v, i) __atomic_store_n(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic_long_add(i, v) __atomic_fetch_add(&(v)->counter, (i), __ATOMIC_RELAXED)
+#define atomic_long_sub(i, v) __atomic_fetch_sub(&(v)->counter, (i), __ATOMIC_RELAXED)
+
+// Time
+static inline u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Allocation
+#define PAGE_SIZE ((size_t)sysconf(_SC_PAGESIZE))
+#define PAGE_ALIGN(x) (((x) + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1))
+
+#define GFP_KERNEL 0
+
+static inline void *kmalloc(size_t size, int flags)
+{
+	(void)flags;
+	return malloc(size);
+}
+
+static inline void *kzalloc(size_t size, int flags)
+{
+	(void)flags;
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *p)
+{
+	free((void *)p);
+}
+
+// Zeroed and page aligned, like the mappable kernel buffer
+static inline void *vmalloc_user(size_t size)
+{
+	void *p;
+
+	if (posix_memalign(&p, PAGE_SIZE, size))
+		return NULL;
+	return memset(p, 0, size);
+}
+
+static inline void *vmalloc(size_t size)
+{
+	return malloc(size);
+}
+
+static inline void vfree(const void *p)
+{
+	free((void *)p);
+}
+
+#define struct_size(p, member, n) (sizeof(*(p)) + (n) * sizeof((p)->member[0]))
+
+// Sleeping locks
+struct mutex
+{
+	pthread_mutex_t lock;
+};
+
+static inline void mutex_init(struct mutex *m)
+{
+	pthread_mutex_init(&m->lock, NULL);
+}
+
+static inline void mutex_destroy(struct mutex *m)
+{
+	pthread_mutex_destroy(&m->lock);
+}
+
+static inline void mutex_lock(struct mutex *m)
+{
+	pthread_mutex_lock(&m->lock);
+}
+
+static inline int mutex_trylock(struct mutex *m)
+{
+	return pthread_mutex_trylock(&m->lock) == 0;
+}
+
+static inline void mutex_unlock(struct mutex *m)
+{
+	pthread_mutex_unlock(&m->lock);
+}
+
+// Allocating xarray: a growable table of pointers, ids are the lowest
+// free indices. Internally locked like the kernel one.
+#define XA_FLAGS_ALLOC 0
+
+struct xa_limit
+{
+	u32 max;
+	u32 min;
+};
+
+#define xa_limit_32b ((struct xa_limit){ .max = UINT32_MAX, .min = 0 })
+
+struct xarray
+{
+	pthread_mutex_t lock;
+	void **slots;
+	unsigned long nr;
+};
+
+static inline void xa_init_flags(struct xarray *xa, int flags)
+{
+	(void)flags;
+	pthread_mutex_init(&xa->lock, NULL);
+	xa->slots = NULL;
+	xa->nr = 0;
+}
+
+static inline void xa_destroy(struct xarray *xa)
+{
+	free(xa->slots);
+	xa->slots = NULL;
+	xa->nr = 0;
+	pthread_mutex_destroy(&xa->lock);
+}
+
+static inline int xa_alloc(struct xarray *xa, u32 *id, void *entry, struct xa_limit limit, int gfp)
+{
+	unsigned long i;
+	int err = 0;
+
+	(void)gfp;
+	pthread_mutex_lock(&xa->lock);
+	for (i = limit.min; i < xa->nr && xa->slots[i]; i++)
+		;
+	if (i > limit.max)
+		err = -EBUSY;
+	else if (i == xa->nr)
+	{
+		unsigned long nr = xa->nr ? xa->nr * 2 : 16;
+		void **slots = realloc(xa->slots, nr * sizeof(*slots));
+
+		if (!slots)
+			err = -ENOMEM;
+		else
+		{
+			memset(slots + xa->nr, 0, (nr - xa->nr) * sizeof(*slots));
+			xa->slots = slots;
+			xa->nr = nr;
+		}
+	}
+	if (!err)
+	{
+		xa->slots[i] = entry;
+		*id = i;
+	}
+	pthread_mutex_unlock(&xa->lock);
+	return err;
+}
+
+static inline void *xa_load(struct xarray *xa, unsigned long index)
+{
+	void *entry = NULL;
+
+	pthread_mutex_lock(&xa->lock);
+	if (index < xa->nr)
+		entry = xa->slots[index];
+	pthread_mutex_unlock(&xa->lock);
+	return entry;
+}
+
+static inline void *xa_erase(struct xarray *xa, unsigned long index)
+{
+	void *entry = NULL;
+
+	pthread_mutex_lock(&xa->lock);
+	if (index < xa->nr)
+	{
+		entry = xa->slots[index];
+		xa->slots[index] = NULL;
+	}
+	pthread_mutex_unlock(&xa->lock);
+	return entry;
+}
+
+// First entry at or after "*index", NULL past the end
+static inline void *xa_find(struct xarray *xa, unsigned long *index)
+{
+	void *entry = NULL;
+
+	pthread_mutex_lock(&xa->lock);
+	for (; *index < xa->nr && !(entry = xa->slots[*index]); (*index)++)
+		;
+	pthread_mutex_unlock(&xa->lock);
+	return entry;
+}
+
+#define xa_for_each(xa, index, entry) \
+	for ((index) = 0; ((entry) = xa_find((xa), &(index))); (index)++)
+
+// Iterators over kernel buffers (kvec) or user ones (iovec), which are the
+// same thing here
+#define ITER_SOURCE 1
+#define ITER_DEST 0
+
+struct kvec
+{
+	void *iov_base;
+	size_t iov_len;
+};
+
+struct iov_iter
+{
+	const struct iovec *iov;
+	unsigned long nr_segs;
+	size_t iov_offset;	// Into iov[0]
+	size_t count;
+};
+
+static inline void iov_iter_init(struct iov_iter *i, unsigned int direction, const struct iovec *iov, unsigned long nr_segs, size_t count)
+{
+	(void)direction;
+	i->iov = iov;
+	i->nr_segs = nr_segs;
+	i->iov_offset = 0;
+	i->count = count;
+}
+
+static inline void iov_iter_kvec(struct iov_iter *i, unsigned int direction, const struct kvec *kvec, unsigned long nr_segs, size_t count)
+{
+	iov_iter_init(i, direction, (const struct iovec *)kvec, nr_segs, count);
+}
+
+static inline size_t iov_iter_count(const struct iov_iter *i)
+{
+	return i->count;
+}
+
+static inline size_t iov_length(const struct iovec *iov, unsigned long nr_segs)
+{
+	size_t len = 0;
+	unsigned long seg;
+
+	for (seg = 0; seg < nr_segs; seg++)
+		len += iov[seg].iov_len;
+	return len;
+}
+
+// Copy between "buf" and the iterator, "to_iter" says which way
+static inline size_t iovIterCopy(struct iov_iter *i, void *buf, size_t bytes, bool to_iter)
+{
+	size_t done = 0;
+
+	bytes = min(bytes, i->count);
+	while (done < bytes)
+	{
+		size_t n = min(bytes - done, i->iov->iov_len - i->iov_offset);
+		char *seg = (char *)i->iov->iov_base + i->iov_offset;
+
+		if (to_iter)
+			memcpy(seg, (char *)buf + done, n);
+		else
+			memcpy((char *)buf + done, seg, n);
+		done += n;
+		i->iov_offset += n;
+		if (i->iov_offset == i->iov->iov_len)
+		{
+			i->iov++;
+			i->nr_segs--;
+			i->iov_offset = 0;
+		}
+	}
+	i->count -= done;
+	return done;
+}
+
+static inline size_t copy_from_iter(void *addr, size_t bytes, struct iov_iter *i)
+{
+	return iovIterCopy(i, addr, bytes, false);
+}
+
+static inline size_t copy_to_iter(const void *addr, size_t bytes, struct iov_iter *i)
+{
+	return iovIterCopy(i, (void *)addr, bytes, true);
+}
+
+#endif
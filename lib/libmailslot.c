@@ -0,0 +1,224 @@
+/* Userspace helpers for the mmap'd mailslot ring */
+
+#include <errno.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "libmailslot.h"
+
+#define load_acquire(p) __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+int mailslot_ring_map(struct mailslot_ring *r, int fd)
+{
+	struct mailslot_ring_hdr *hdr;
+	size_t size;
+
+	// 1. Map the header page to learn the geometry
+	hdr = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return -errno;
+	size = hdr->data_offset + (size_t)hdr->size;
+	munmap(hdr, sysconf(_SC_PAGESIZE));
+
+	// 2. Map the whole ring
+	hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+		return -errno;
+
+	r->fd = fd;
+	r->hdr = hdr;
+	r->data = (char *)hdr + hdr->data_offset;
+	r->map_size = size;
+	return 0;
+}
+
+void mailslot_ring_unmap(struct mailslot_ring *r)
+{
+	munmap(r->hdr, r->map_size);
+	r->hdr = NULL;
+}
+
+// Wake the driver side if it flagged a sleeper. The full fence orders our
+// index store before the flag load, pairing with the driver's smp_mb().
+static void wakeIfWaiting(struct mailslot_ring *r, __u32 *flag)
+{
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(flag, __ATOMIC_RELAXED))
+		ioctl(r->fd, MAILSLOT_IOC_WAKE);
+}
+
+// Messages above the inline threshold live in driver buffers, hand them
+// to write(). It blocks like write() unless the descriptor is O_NONBLOCK.
+static int writeLarge(struct mailslot_ring *r, const void *buf, size_t len)
+{
+	if (write(r->fd, buf, len) < 0)
+		return errno == EINVAL ? -EMSGSIZE : -errno;
+	return 0;
+}
+
+// read() delivers the payload followed by a newline, so "buf" needs a spare byte
+static ssize_t readLarge(struct mailslot_ring *r, void *buf, size_t len)
+{
+	ssize_t ret = read(r->fd, buf, len);
+
+	if (ret < 0)
+		return errno == EINVAL ? -EMSGSIZE : -errno;
+	return ret - 1;
+}
+
+// CLOCK_MONOTONIC in nanoseconds, the driver's ktime_get_ns()
+static __u64 monotonicNs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (__u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int mailslot_ring_push(struct mailslot_ring *r, const void *buf, size_t len)
+{
+	struct mailslot_ring_hdr *hdr = r->hdr;
+	__u32 ttl_ms = __atomic_load_n(&hdr->ttl_ms, __ATOMIC_RELAXED);
+	size_t expiry = ttl_ms ? sizeof(__u64) : 0;
+	__u32 tail = hdr->tail;
+	__u32 off = tail & (hdr->size - 1);
+	__u32 need = MAILSLOT_RECORD_SIZE(expiry + len);
+	__u32 pad = off + need > hdr->size ? hdr->size - off : 0;
+	struct mailslot_record *rec;
+	char *payload;
+
+	if (len > hdr->max_msg)
+		return -EMSGSIZE;
+	if (len > hdr->inline_max)
+		return writeLarge(r, buf, len);
+	if (tail - load_acquire(&hdr->head) + pad + need > hdr->size)
+		return -EAGAIN;
+
+	// A record never wraps, fill the end of the ring with padding instead
+	if (pad)
+	{
+		rec = (struct mailslot_record *)(r->data + off);
+		rec->len = pad - sizeof(*rec);
+		rec->flags = MAILSLOT_RECORD_PAD;
+		off = 0;
+	}
+
+	rec = (struct mailslot_record *)(r->data + off);
+	rec->len = expiry + len;
+	rec->flags = 0;
+	payload = (char *)(rec + 1);
+	if (ttl_ms)
+	{
+		// Deadline first, like the driver's records
+		rec->flags = MAILSLOT_RECORD_EXPIRES;
+		*(__u64 *)payload = monotonicNs() + (__u64)ttl_ms * 1000000;
+		payload += sizeof(__u64);
+	}
+	memcpy(payload, buf, len);
+	store_release(&hdr->tail, tail + pad + need);
+
+	wakeIfWaiting(r, &hdr->reader_waiting);
+	return 0;
+}
+
+ssize_t mailslot_ring_pop(struct mailslot_ring *r, void *buf, size_t len)
+{
+	struct mailslot_ring_hdr *hdr = r->hdr;
+	__u32 head = hdr->head;
+	__u32 tail = load_acquire(&hdr->tail);
+	struct mailslot_record *rec;
+	const char *payload;
+	size_t msg_len;
+
+	// Skip the messages whose time to live elapsed
+	for (;;)
+	{
+		__u32 off = head & (hdr->size - 1);
+
+		if (tail == head)
+		{
+			// Hand the expired ones back even if nothing is left
+			if (head != hdr->head)
+			{
+				store_release(&hdr->head, head);
+				wakeIfWaiting(r, &hdr->writer_waiting);
+			}
+			return -EAGAIN;
+		}
+
+		rec = (struct mailslot_record *)(r->data + off);
+		if (rec->flags & MAILSLOT_RECORD_PAD)
+		{
+			head += hdr->size - off;
+			rec = (struct mailslot_record *)r->data;
+		}
+
+		// The driver drops expired out-of-line messages itself
+		if (rec->flags & MAILSLOT_RECORD_EXTERNAL)
+		{
+			if (head != hdr->head)
+				store_release(&hdr->head, head);
+			return readLarge(r, buf, len);
+		}
+
+		payload = (const char *)(rec + 1);
+		msg_len = rec->len;
+		if (!(rec->flags & MAILSLOT_RECORD_EXPIRES))
+			break;
+		msg_len -= sizeof(__u64);
+		payload += sizeof(__u64);
+		if (*(const __u64 *)(rec + 1) > monotonicNs())
+			break;
+		head += MAILSLOT_RECORD_SIZE(rec->len);
+	}
+
+	if (msg_len > len)
+	{
+		if (head != hdr->head)
+			store_release(&hdr->head, head);
+		return -EMSGSIZE;
+	}
+
+	memcpy(buf, payload, msg_len);
+	store_release(&hdr->head, head + MAILSLOT_RECORD_SIZE(rec->len));
+
+	wakeIfWaiting(r, &hdr->writer_waiting);
+	return msg_len;
+}
+
+// Sleep until the descriptor reports "events"; the driver's poll flags us
+// as a waiter so the peer knows to wake us up.
+static int waitFor(struct mailslot_ring *r, short events)
+{
+	struct pollfd pfd = { .fd = r->fd, .events = events };
+
+	if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+		return -errno;
+	return 0;
+}
+
+int mailslot_ring_push_wait(struct mailslot_ring *r, const void *buf, size_t len)
+{
+	int err;
+
+	while ((err = mailslot_ring_push(r, buf, len)) == -EAGAIN)
+		if ((err = waitFor(r, POLLOUT)))
+			return err;
+	return err;
+}
+
+ssize_t mailslot_ring_pop_wait(struct mailslot_ring *r, void *buf, size_t len)
+{
+	ssize_t ret;
+	int err;
+
+	while ((ret = mailslot_ring_pop(r, buf, len)) == -EAGAIN)
+		if ((err = waitFor(r, POLLIN)))
+			return err;
+	return ret;
+}
@@ -0,0 +1,39 @@
+/* Userspace helpers for the mmap'd mailslot ring */
+
+#ifndef _LIBMAILSLOT_H
+#define _LIBMAILSLOT_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "../mailslot.h"
+
+struct mailslot_ring
+{
+	int fd;				// Open /dev/mailslot* descriptor
+	struct mailslot_ring_hdr *hdr;	// Start of the mapping
+	char *data;			// Start of the record ring
+	size_t map_size;
+};
+
+// Map the ring of an open mailslot. The descriptor must be open O_RDWR:
+// a shared mapping needs read access and the writable one write access,
+// whichever side of the queue it is used for. Returns 0 or -errno.
+int mailslot_ring_map(struct mailslot_ring *r, int fd);
+void mailslot_ring_unmap(struct mailslot_ring *r);
+
+// Non-blocking enqueue/dequeue, no syscall unless a peer sleeps in the driver.
+// Messages above the ring's inline_max go through write()/read() instead;
+// popping one needs a buffer one byte larger than the message, and both
+// block like read()/write() unless the descriptor is O_NONBLOCK. pop skips
+// the messages past their time to live (MAILSLOT_IOC_SET_TTL).
+// push returns 0, -EAGAIN when full or -EMSGSIZE.
+// pop returns the message length, -EAGAIN when empty or -EMSGSIZE if "len" is too small.
+int mailslot_ring_push(struct mailslot_ring *r, const void *buf, size_t len);
+ssize_t mailslot_ring_pop(struct mailslot_ring *r, void *buf, size_t len);
+
+// Blocking variants, sleep in poll() on the mailslot descriptor
+int mailslot_ring_push_wait(struct mailslot_ring *r, const void *buf, size_t len);
+ssize_t mailslot_ring_pop_wait(struct mailslot_ring *r, void *buf, size_t len);
+
+#endif
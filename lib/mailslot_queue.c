@@ -0,0 +1,87 @@
+/* Userspace build of the mailslot queue, see mailslot_queue.h. Mirrors the
+ * driver's locked mode: one mutex around the same push/pop the driver
+ * runs (mailslot_ring.c), time to live and out-of-line payloads included. */
+
+#include "kcompat.h"
+#include "../mailslot_ring.h"
+#include "mailslot_queue.h"
+
+struct mailslot_queue
+{
+	struct mutex mutex;
+	struct mailslot_engine eng;
+};
+
+struct mailslot_queue *mailslot_queue_create(unsigned int size, unsigned int max_msg, unsigned int inline_max, unsigned int ttl_ms)
+{
+	struct mailslot_queue *q;
+
+	if (inline_max > max_msg)
+		inline_max = max_msg;
+	if (max_msg == 0 || size == 0 || (size & (size - 1)) ||
+	    2 * MAILSLOT_RECORD_SIZE(sizeof(__u64) + (size_t)max(inline_max, (unsigned int)sizeof(struct mailslot_external))) > size)
+		return NULL;
+
+	q = kzalloc(sizeof(*q), GFP_KERNEL);
+	if (!q)
+		return NULL;
+
+	if (mailslot_engine_init(&q->eng, size, max_msg, inline_max))
+	{
+		kfree(q);
+		return NULL;
+	}
+	mutex_init(&q->mutex);
+	q->eng.ttl = (u64)ttl_ms * 1000000;
+	q->eng.shared->ttl_ms = ttl_ms;
+	return q;
+}
+
+void mailslot_queue_destroy(struct mailslot_queue *q)
+{
+	mutex_destroy(&q->mutex);
+	mailslot_engine_destroy(&q->eng);
+	kfree(q);
+}
+
+int mailslot_queue_push(struct mailslot_queue *q, const void *buf, size_t len)
+{
+	struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+	struct iov_iter from;
+	int err;
+
+	iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, len);
+
+	mutex_lock(&q->mutex);
+	err = mailslot_engine_push(&q->eng, &from, len);
+	mutex_unlock(&q->mutex);
+
+	if (err == -ENOSPC)
+		return -EAGAIN;
+	if (err == -EINVAL)
+		return -EMSGSIZE;
+	return err;
+}
+
+ssize_t mailslot_queue_pop(struct mailslot_queue *q, void *buf, size_t len)
+{
+	struct mailslot_ring_hdr *hdr = q->eng.shared;
+	struct kvec kv = { .iov_base = buf, .iov_len = len };
+	unsigned int head, expired = 0;
+	struct iov_iter to;
+	size_t msg_len;
+	int err;
+
+	iov_iter_kvec(&to, ITER_DEST, &kv, 1, len);
+
+	mutex_lock(&q->mutex);
+	head = hdr->head;
+	err = mailslot_engine_pop(&q->eng, &head, smp_load_acquire(&hdr->tail), &to, &msg_len, &expired, 0);
+	if (!err || expired)
+		smp_store_release(&hdr->head, head);
+	mutex_unlock(&q->mutex);
+
+	if (err == -EINVAL)
+		return -EMSGSIZE;
+	return err ? err : (ssize_t)msg_len;
+}
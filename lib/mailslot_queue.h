@@ -0,0 +1,26 @@
+/* Userspace build of the mailslot queue: the driver's record ring and
+ * locked push/pop, without a device, for tests and benchmarks */
+
+#ifndef _MAILSLOT_QUEUE_H
+#define _MAILSLOT_QUEUE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+struct mailslot_queue;
+
+// "size" must be a power of two holding two records of "inline_max"
+// bytes; larger messages, up to "max_msg", are stored out of line as in
+// the driver. "ttl_ms" is the time to live of the messages (0 = forever).
+// Returns NULL on invalid geometry or allocation failure.
+struct mailslot_queue *mailslot_queue_create(unsigned int size, unsigned int max_msg, unsigned int inline_max, unsigned int ttl_ms);
+void mailslot_queue_destroy(struct mailslot_queue *q);
+
+// Non-blocking, safe from any number of threads.
+// push returns 0, -EAGAIN when full, -EMSGSIZE, -ENOMEM or -EIO.
+// pop skips expired messages and returns the message length, -EAGAIN when
+// empty or -EMSGSIZE if "len" is too small.
+int mailslot_queue_push(struct mailslot_queue *q, const void *buf, size_t len);
+ssize_t mailslot_queue_pop(struct mailslot_queue *q, void *buf, size_t len);
+
+#endif
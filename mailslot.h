@@ -0,0 +1,225 @@
+/* Mailslot user/kernel interface: ioctl commands and the mmap'd ring layout */
+
+#ifndef _MAILSLOT_H
+#define _MAILSLOT_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Shared ring, mapped with mmap(fd, offset 0).
+ *
+ * The mapping starts with struct mailslot_ring_hdr, followed by a ring of
+ * "size" bytes at "data_offset". head and tail are free running byte
+ * offsets, masked with (size - 1). Each message is a struct mailslot_record
+ * followed by its payload, padded to MAILSLOT_RECORD_ALIGN. A record never
+ * wraps: when it would not fit before the end of the ring, the producer
+ * fills the remaining space with a MAILSLOT_RECORD_PAD record and starts
+ * over at offset 0. Messages above "inline_max" bytes are kept out of line
+ * by the driver: their record is a MAILSLOT_RECORD_EXTERNAL one holding a
+ * struct mailslot_external, and only read() can deliver them (mmap
+ * producers must write() such messages, mmap consumers must read() them
+ * when they meet one). While a time to live is set ("ttl_ms"), records
+ * carry MAILSLOT_RECORD_EXPIRES and their payload starts with a __u64
+ * CLOCK_MONOTONIC deadline in nanoseconds; consumers skip the ones past it.
+ * The producer writes its records, then publishes them
+ * with a release store of tail; the consumer reads tail with an acquire
+ * load and hands the bytes back with a release store of head.
+ *
+ * Each side (producing or consuming) must be driven either through the
+ * mapping or through read()/write(), never both at once: the driver only
+ * serializes its own callers.
+ */
+struct mailslot_ring_hdr
+{
+	__u32 head;		// Byte offset of the next record to read
+	__u32 reader_waiting;	// Set by the driver before a reader sleeps
+	__u8 pad0[56];
+	__u32 tail;		// Byte offset of the next record to write
+	__u32 writer_waiting;	// Set by the driver before a writer sleeps
+	__u8 pad1[56];
+	__u32 size;		// Ring bytes, a power of two
+	__u32 max_msg;		// Maximum payload bytes per message
+	__u32 data_offset;	// Offset of the ring from the start of the mapping
+	__u32 inline_max;	// Larger messages are stored out of line
+	__u32 ttl_ms;		// Time to live of new messages, 0 = forever
+	__u32 pad2;
+};
+
+struct mailslot_record
+{
+	__u32 len;	// Payload bytes (padding records: bytes to skip)
+	__u32 flags;	// MAILSLOT_RECORD_*
+};
+
+#define MAILSLOT_RECORD_PAD 0x1	// Skip to the start of the ring
+#define MAILSLOT_RECORD_EXTERNAL 0x2	// Payload is a struct mailslot_external
+#define MAILSLOT_RECORD_EXPIRES 0x4	// Payload starts with a __u64 deadline
+
+// Reference to a payload held by the driver
+struct mailslot_external
+{
+	__u32 id;	// Driver handle
+	__u32 len;	// Message bytes
+};
+
+#define MAILSLOT_RECORD_ALIGN 8
+#define MAILSLOT_RECORD_SIZE(len) \
+	((sizeof(struct mailslot_record) + (len) + MAILSLOT_RECORD_ALIGN - 1) & ~(MAILSLOT_RECORD_ALIGN - 1))
+
+#define MAILSLOT_IOC_MAGIC 0xB5
+
+// Wake readers and writers sleeping in the driver. Called by mmap users
+// after moving tail (if reader_waiting) or head (if writer_waiting).
+#define MAILSLOT_IOC_WAKE _IO(MAILSLOT_IOC_MAGIC, 0)
+
+/*
+ * Batched read. Drains queued messages into "buf" under one lock
+ * acquisition, blocking for the first one unless O_NONBLOCK. Each message
+ * is stored as a __u32 length followed by the payload, padded to 4 bytes
+ * (see MAILSLOT_BATCH_RECORD_SIZE). Returns the number of messages read.
+ */
+struct mailslot_batch
+{
+	__u64 buf;	// User buffer address
+	__u32 len;	// Buffer size in bytes
+	__u32 count;	// In: max messages (0 = no limit), out: messages read
+	__u32 bytes;	// Out: bytes used in buf
+	__u32 pad;
+};
+
+#define MAILSLOT_BATCH_RECORD_SIZE(len) (sizeof(__u32) + (((len) + 3) & ~3u))
+
+#define MAILSLOT_IOC_READ_BATCH _IOWR(MAILSLOT_IOC_MAGIC, 1, struct mailslot_batch)
+
+/*
+ * Batched write. Every iovec becomes a separate message; the batch is
+ * enqueued all or nothing, blocking until it fits unless O_NONBLOCK.
+ * Returns the number of messages written.
+ */
+struct mailslot_iov_batch
+{
+	__u64 iov;	// Address of a struct iovec array
+	__u32 iovcnt;	// Number of entries, the records must fit the ring
+	__u32 pad;
+};
+
+#define MAILSLOT_IOC_WRITE_BATCH _IOW(MAILSLOT_IOC_MAGIC, 2, struct mailslot_iov_batch)
+
+/*
+ * Queue engine, passed by value. In SPSC mode read() and write() skip the
+ * instance mutex while a single descriptor is open for reading (resp.
+ * writing) and only fall back to it when more are opened. Threads sharing
+ * that descriptor are serialized: one at a time takes the fast path, the
+ * others wait for it on the mutex path.
+ *
+ * In broadcast mode every descriptor open for reading is a subscriber with
+ * its own cursor and receives every message; a message is reclaimed once
+ * all subscribers have read it. New subscribers start from the oldest
+ * message still queued. When the ring is full, writers wait for the
+ * slowest subscriber (BROADCAST, or as MAILSLOT_IOC_SET_OVERFLOW says) or
+ * the oldest messages are dropped for the subscribers that have not read
+ * them yet (BROADCAST_DROP). The ring
+ * cannot be mapped in broadcast mode.
+ *
+ * In staged mode small priority 0 writes (up to 256 bytes and the inline
+ * size) land in a per-CPU buffer instead of taking the instance mutex, and
+ * are moved into the ring in batches: when a buffer fills up, when a
+ * reader finds the ring empty, and within a jiffy otherwise. Messages
+ * written from one CPU stay in order, larger ones waiting for the staged
+ * ones to reach the ring, but there is no global order across CPUs, and a
+ * message's time to live starts when it reaches the ring.
+ * Readers and larger or prioritized writes behave as in locked mode.
+ *
+ * In MPMC mode read() and write() never take the instance mutex, whatever
+ * the number of readers and writers: messages go through a lock-free
+ * queue of fixed-size slots, one per message of up to the maximum message
+ * size, as many as fit the ring size (rounded down to a power of two).
+ * Priorities, batches, peeking and the mapping are not available, and a
+ * full queue can only block or reject writers. The mode can only be
+ * entered and left while nothing is queued or mapped.
+ */
+#define MAILSLOT_MODE_LOCKED 0
+#define MAILSLOT_MODE_SPSC 1
+#define MAILSLOT_MODE_BROADCAST 2
+#define MAILSLOT_MODE_BROADCAST_DROP 3
+#define MAILSLOT_MODE_STAGED 4
+#define MAILSLOT_MODE_MPMC 5
+
+#define MAILSLOT_IOC_SET_MODE _IO(MAILSLOT_IOC_MAGIC, 3)
+
+/*
+ * Ring geometry of an instance. New instances use the module's "ring_size",
+ * "message_size" and "inline_size" parameters. The ring must hold two
+ * records of the largest inline size. SET only succeeds while the caller is the
+ * sole user of the instance and nothing is queued or mapped; the override
+ * lasts as long as the instance (it is freed once idle and empty).
+ */
+struct mailslot_geometry
+{
+	__u32 ring_size;	// Ring bytes, a power of two
+	__u32 max_message_size;	// Larger writes fail with EINVAL
+	__u32 inline_size;	// Larger messages are stored out of line
+	__u32 pad;
+};
+
+#define MAILSLOT_IOC_SET_GEOMETRY _IOW(MAILSLOT_IOC_MAGIC, 4, struct mailslot_geometry)
+#define MAILSLOT_IOC_GET_GEOMETRY _IOR(MAILSLOT_IOC_MAGIC, 5, struct mailslot_geometry)
+
+/*
+ * Priority of the messages written through this descriptor, passed by
+ * value: 0 (default) to MAILSLOT_PRIORITIES - 1. Readers always get the
+ * oldest message of the highest non-empty priority. Priority 0 lives in
+ * the ring; higher ones are queued inside the driver, so they are only
+ * available in MAILSLOT_MODE_LOCKED and MAILSLOT_MODE_STAGED and are not
+ * visible through the mapping.
+ */
+#define MAILSLOT_PRIORITIES 4
+
+#define MAILSLOT_IOC_SET_PRIORITY _IO(MAILSLOT_IOC_MAGIC, 6)
+
+/*
+ * Look at a queued message without consuming it: the "index"-th one (0 =
+ * next) a read() on this descriptor would return, in priority order. Up to
+ * "len" bytes of its payload are copied to "buf" (len 0 only reports its
+ * length), without the newline read() appends. Never blocks, fails with
+ * EAGAIN if fewer messages are queued. Returns the message length.
+ */
+struct mailslot_peek
+{
+	__u64 buf;	// User buffer address
+	__u32 len;	// Buffer size in bytes
+	__u32 index;	// Message to look at, 0 = next
+	__u32 msg_len;	// Out: message length
+	__u32 pad;
+};
+
+#define MAILSLOT_IOC_PEEK _IOWR(MAILSLOT_IOC_MAGIC, 7, struct mailslot_peek)
+
+/*
+ * Time to live of the messages written from now on, in milliseconds,
+ * passed by value (0 = forever, the default). Expired messages are dropped
+ * lazily: readers skip them, and writers finding the instance full reclaim
+ * them unless the ring is mapped or in MAILSLOT_MODE_SPSC. Messages queued
+ * before the call keep their deadline. Lasts as long as the instance.
+ */
+#define MAILSLOT_IOC_SET_TTL _IO(MAILSLOT_IOC_MAGIC, 8)
+
+/*
+ * What writers do when the instance is full, passed by value:
+ * BLOCK (default) waits for room, or fails with EAGAIN if O_NONBLOCK;
+ * REJECT fails at once with ENOSPC; DROP_OLDEST reclaims the oldest
+ * unread messages (of the writer's priority or lower) to make room;
+ * GROW doubles the ring, up to 64 MiB, before falling back to BLOCK.
+ * DROP_OLDEST and GROW cannot act while the ring is mapped or in
+ * MAILSLOT_MODE_SPSC, writers then wait as with BLOCK. Lasts as long as
+ * the instance.
+ */
+#define MAILSLOT_OVERFLOW_BLOCK 0
+#define MAILSLOT_OVERFLOW_REJECT 1
+#define MAILSLOT_OVERFLOW_DROP_OLDEST 2
+#define MAILSLOT_OVERFLOW_GROW 3
+
+#define MAILSLOT_IOC_SET_OVERFLOW _IO(MAILSLOT_IOC_MAGIC, 9)
+
+#endif
@@ -0,0 +1,2727 @@
+/* Mailslot implementation using Kernel Module */
+
+#define EXPORT_SYMTAB
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/init.h>
+#include <linux/fs.h>
+#include <linux/sched.h>	
+#include <linux/pid.h>		/* For pid types */
+#include <linux/version.h>	/* For LINUX_VERSION_CODE */
+#include <linux/slab.h>		/* For kmalloc, kmem_cache */
+#include <asm/uaccess.h>	/* For copy_to_user */
+#include <linux/cdev.h>		/* Modern way to handle cdevs (cdev_alloc())*/
+#include <linux/mutex.h>	/* Mutual exclusion */
+#include <linux/percpu-rwsem.h>	/* Draining the SPSC fast path */
+#include <linux/wait.h>		/* Wait queues for blocking read/write */
+#include <linux/poll.h>		/* poll/select/epoll support */
+#include <linux/mm.h>		/* mmap support */
+#include <linux/vmalloc.h>	/* For vmalloc_user (mappable ring) */
+#include <linux/uio.h>		/* For struct iovec, iov_iter, UIO_FASTIOV */
+#include <linux/splice.h>	/* splice/sendfile support */
+#include <linux/percpu.h>	/* Per-CPU statistics */
+#include <linux/debugfs.h>	/* Statistics export */
+#include <linux/seq_file.h>
+#include <linux/rcupdate.h>	/* Lazy instance publication */
+#include <linux/refcount.h>
+#include <linux/moduleparam.h>	/* Load-time sizing */
+#include <linux/log2.h>		/* For is_power_of_2 */
+#include <linux/xarray.h>	/* Out-of-line payloads */
+#include <linux/overflow.h>	/* For struct_size */
+#include <linux/timekeeping.h>	/* Message expiry */
+#include <linux/spinlock.h>	/* Per-CPU staging buffers */
+#include <linux/workqueue.h>	/* Their periodic flush */
+#include <linux/wait_bit.h>	/* SPSC side ownership */
+
+#include "mailslot.h"		/* ioctl commands and shared ring layout */
+#include "mailslot_ring.h"	/* Record engine, shared with the userspace build */
+
+#define CREATE_TRACE_POINTS
+#include "mailslot_trace.h"	/* push/pop/full/empty tracepoints */
+
+MODULE_LICENSE("GPL");
+MODULE_AUTHOR("Michele Rullo");
+
+/* ioctl operations */
+static int mailslot_open(struct inode *, struct file *);
+static int mailslot_release(struct inode *, struct file *);
+static ssize_t mailslot_read_iter(struct kiocb * iocb, struct iov_iter * to);
+static ssize_t mailslot_write_iter(struct kiocb * iocb, struct iov_iter * from);
+static unsigned int mailslot_poll(struct file * filp, poll_table * wait);
+static int mailslot_mmap(struct file * filp, struct vm_area_struct * vma);
+static long mailslot_ioctl(struct file * filp, unsigned int cmd, unsigned long arg);
+
+
+// iov_iter directions were named after the syscalls before 6.2
+#ifndef ITER_SOURCE
+#define ITER_SOURCE WRITE
+#define ITER_DEST READ
+#endif
+
+#define DEVICE_NAME "mailslot"
+#define MINOR_LOWER 0
+
+// Defaults and limits for the module parameters below
+#define INSTANCES 256
+#define MESSAGE_SIZE 256
+#define RING_SIZE 65536		// Must be a power of two
+#define INLINE_SIZE 2048	// Larger messages are stored out of line
+#define MAX_INSTANCES (MINORMASK + 1)
+#define MAX_MESSAGE_SIZE (64 << 20)
+#define MAX_RING_BYTES (64 << 20)
+#define MAX_URGENT_BYTES (1 << 20)	// Bytes queued above priority 0 per instance
+#define STAGE_SIZE 4096		// Per-CPU staging buffer of MAILSLOT_MODE_STAGED
+#define STAGE_MSG_MAX 256	// Larger messages bypass it
+#define STAGE_FLUSH (STAGE_SIZE / 2)	// Writers flush their buffer past this
+#define STAGE_DELAY 1		// Jiffies before staged messages are flushed anyway
+#define SLOT_DEAD U32_MAX	// MPMC slot whose producer faulted, skipped by readers
+#define SPSC_READER 0		// spsc_owner bits
+#define SPSC_WRITER 1
+
+static unsigned int nr_instances = INSTANCES;
+module_param_named(instances, nr_instances, uint, 0444);
+MODULE_PARM_DESC(instances, "Number of mailslot minors (default 256)");
+
+static unsigned int message_size = MESSAGE_SIZE;
+module_param(message_size, uint, 0444);
+MODULE_PARM_DESC(message_size, "Default maximum message size in bytes (default 256)");
+
+static unsigned int ring_size = RING_SIZE;
+module_param(ring_size, uint, 0444);
+MODULE_PARM_DESC(ring_size, "Default ring size in bytes, a power of two (default 65536)");
+
+static unsigned int inline_size = INLINE_SIZE;
+module_param(inline_size, uint, 0444);
+MODULE_PARM_DESC(inline_size, "Default largest message stored inside the ring, larger ones get their own buffer (default 2048)");
+
+static int Major;            /* Major number assigned to broadcast device driver */
+struct cdev *mailslot_cdev;
+
+// Per-CPU instance counters, summed when read through debugfs
+struct mailslot_stats
+{
+	u64 pushed;		// Messages enqueued
+	u64 popped;		// Messages dequeued
+	u64 dropped_full;	// Writes rejected because the mailslot was full
+	u64 dropped_slow;	// Messages reclaimed unread to make room (drop-oldest policy)
+	u64 expired;		// Messages dropped because their time to live elapsed
+	u64 bytes_in;
+	u64 bytes_out;
+	u64 contended;		// Mutex acquisitions that had to wait
+	unsigned int high_water;	// Most bytes queued seen on this CPU
+};
+
+// Mailslot instance struct
+struct mailslot
+{
+	int minor;		// Minor number of the device
+	refcount_t refs;	// Open file descriptors, 0 while kept only for queued messages
+	int opened;		// Number of open file descriptors
+	int readers;		// Open descriptors with FMODE_READ
+	int writers;		// Open descriptors with FMODE_WRITE
+	int mode;		// MAILSLOT_MODE_*
+	int overflow;		// MAILSLOT_OVERFLOW_*, what writers do when it is full
+	struct mutex mutex;	 // Mutual exclusion on mailslot (device)
+	struct percpu_rw_semaphore fast_sem;	// Held for read by SPSC fast paths
+	unsigned long spsc_owner;	// SPSC_READER/SPSC_WRITER: that side is in use
+	wait_queue_head_t readq;	// Readers waiting for a message
+	wait_queue_head_t writeq;	// Writers waiting for room in the ring
+	struct list_head subscribers;	// Descriptors open for reading, under mutex
+	// Priorities above 0 queue in the driver (priority 0 is the ring), under mutex
+	struct list_head urgent[MAILSLOT_PRIORITIES - 1];	// struct mailslot_urgent by priority - 1
+	unsigned long urgent_mask;	// Bit n set while priority n is not empty
+	size_t urgent_bytes;
+	struct mailslot_engine eng;	// Ring and out-of-line payloads (priority 0)
+	atomic_t mapped;	// Live mmap()s of the ring
+	struct mailslot_stats __percpu *stats;
+	struct mailslot_stage __percpu *stage;	// Allocated on first switch to MAILSLOT_MODE_STAGED
+	struct delayed_work stage_work;	// Flushes what writers left staged
+	struct mailslot_mpmc *mpmc;	// Slots of MAILSLOT_MODE_MPMC, freed after a grace period
+	struct dentry *debugfs;	// Statistics file
+	struct rcu_head rcu;
+};
+
+// Per open file state
+struct mailslot_file
+{
+	struct mailslot *ms;
+	struct list_head node;	// In ms->subscribers if open for reading
+	unsigned int cursor;	// Next record to read in broadcast mode
+	int priority;		// Of the messages written through this file
+};
+
+// A message queued above priority 0
+struct mailslot_urgent
+{
+	struct list_head node;
+	u64 expires;		// ktime_get_ns() deadline, 0 = never
+	size_t len;
+	char data[];
+};
+
+// Per-CPU staging buffer: messages written in MAILSLOT_MODE_STAGED wait
+// here, as struct mailslot_staged records, to be moved into the ring in
+// batches under the instance mutex
+struct mailslot_stage
+{
+	spinlock_t lock;	// Taken after the instance mutex
+	unsigned int used;	// Bytes of records in buf
+	unsigned int count;	// Records in buf
+	unsigned int need;	// Ring bytes they take once flushed, without expiry
+	char buf[STAGE_SIZE];
+};
+
+struct mailslot_staged
+{
+	u32 len;
+	char data[];
+};
+
+#define STAGE_RECORD_SIZE(len) ALIGN(sizeof(struct mailslot_staged) + (len), sizeof(u32))
+
+// Bounded MPMC queue of fixed-size slots (Vyukov). Each slot's sequence
+// number says who may claim it: "pos" while free for the producer of
+// position "pos", "pos + 1" once that message can be read. Producers and
+// consumers claim positions with a compare-and-swap and own the slot
+// until they publish the next sequence number.
+struct mailslot_slot
+{
+	unsigned long seq;
+	u32 len;		// SLOT_DEAD if the copy from user space faulted
+	u64 expires;		// ktime_get_ns() deadline, 0 = never
+	char data[];
+};
+
+struct mailslot_mpmc
+{
+	unsigned int mask;	// Slots - 1
+	size_t slot_size;
+	unsigned int max_msg;	// Payload bytes per slot
+	unsigned long enqueue ____cacheline_aligned_in_smp;	// Next position to write
+	unsigned long dequeue ____cacheline_aligned_in_smp;	// Next position to read
+	char slots[] ____cacheline_aligned_in_smp;
+};
+
+// Slab cache for instance headers (ring storage is vmalloc'd so it can be mmap'd)
+static struct kmem_cache *mailslot_cache;
+
+
+/* Module facilities */
+static int pushMessage(struct mailslot *ms, struct iov_iter *from, size_t len);
+static int pushMessages(struct mailslot *ms, const struct iovec *iov, unsigned int count);
+static int pushUrgent(struct mailslot *ms, int priority, struct iov_iter *from, const struct iovec *iov, unsigned int count);
+static int recordFill(struct mailslot *ms, struct mailslot_record *rec, struct iov_iter *from, size_t len);
+static int getMessage(struct mailslot *ms, struct mailslot_file *mf, struct iov_iter *to, size_t *ret_len);
+static int getMessages(struct mailslot *ms, struct mailslot_file *mf, char __user *buff, size_t len, unsigned int max, size_t *bytes);
+static int getUrgent(struct mailslot *ms, struct iov_iter *to, size_t *ret_len);
+static unsigned int stageFlushAll(struct mailslot *ms);
+static int clearMailslot(struct mailslot *ms);
+static struct mailslot *getInstance(int minor);
+static void putInstance(struct mailslot *ms);
+
+// Mailslots, allocated on first open and published with RCU.
+// Creation and destruction are serialized by instances_lock.
+static struct mailslot __rcu **instances;	// nr_instances entries
+static DEFINE_MUTEX(instances_lock);
+static atomic_t instances_count = ATOMIC_INIT(0);	// Instances currently opened
+
+// Number of queued bytes
+static unsigned int ringUsed(struct mailslot *ms)
+{
+	return mailslot_ring_used(ms->eng.shared, ms->eng.size);
+}
+
+// Bytes a message of "len" occupies inside its record, with its expiry
+// when the instance has a time to live
+static size_t inlineLen(struct mailslot *ms, size_t len)
+{
+	return mailslot_engine_inline_len(&ms->eng, len);
+}
+
+static bool isExpired(u64 expires)
+{
+	return mailslot_expired(expires);
+}
+
+// Bytes taken by a message of "len" appended at "tail", including the
+// padding record needed when it would straddle the end of the ring
+static unsigned int recordNeed(struct mailslot *ms, unsigned int tail, size_t len)
+{
+	return mailslot_record_need(ms->eng.size, tail, inlineLen(ms, len));
+}
+
+// Bytes needed to append one record per iovec at the current tail
+static unsigned int batchNeed(struct mailslot *ms, const struct iovec *iov, unsigned int count)
+{
+	unsigned int tail = READ_ONCE(ms->eng.shared->tail);
+	unsigned int need = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		need += recordNeed(ms, tail + need, iov[i].iov_len);
+	return need;
+}
+
+// Out-of-line bytes needed by one message per iovec
+static size_t largeNeed(struct mailslot *ms, const struct iovec *iov, unsigned int count)
+{
+	size_t need = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		if (iov[i].iov_len > ms->eng.inline_max)
+			need += iov[i].iov_len;
+	return need;
+}
+
+static bool largeFits(struct mailslot *ms, size_t need)
+{
+	return mailslot_engine_large_fits(&ms->eng, need);
+}
+
+static bool ringFits(struct mailslot *ms, const struct iovec *iov, unsigned int count)
+{
+	return ringUsed(ms) + batchNeed(ms, iov, count) <= ms->eng.size &&
+	       largeFits(ms, largeNeed(ms, iov, count));
+}
+
+// Bytes needed to queue one message per iovec above priority 0
+static size_t urgentNeed(const struct iovec *iov, unsigned int count)
+{
+	size_t need = 0;
+	unsigned int i;
+
+	for (i = 0; i < count; i++)
+		need += sizeof(struct mailslot_urgent) + iov[i].iov_len;
+	return need;
+}
+
+// Messages in the MPMC slots. Lockless, exact only when nobody is
+// claiming a slot.
+static unsigned int mpmcUsed(struct mailslot_mpmc *q)
+{
+	unsigned long dequeue = READ_ONCE(q->dequeue);
+	unsigned long enqueue = READ_ONCE(q->enqueue);
+
+	return min_t(unsigned long, enqueue - dequeue, q->mask + 1);
+}
+
+static struct mailslot_slot *slotAt(struct mailslot_mpmc *q, unsigned long pos)
+{
+	return (struct mailslot_slot *)(q->slots + (pos & q->mask) * q->slot_size);
+}
+
+// Whether the slot at the dequeue position holds a published message.
+// Unlike mpmcUsed(), slots claimed by producers still copying do not
+// count: their readers sleep until the message is published.
+static bool mpmcReadable(struct mailslot_mpmc *q)
+{
+	unsigned long pos = READ_ONCE(q->dequeue);
+
+	return (long)(smp_load_acquire(&slotAt(q, pos)->seq) - (pos + 1)) >= 0;
+}
+
+// Whether the slot at the enqueue position is free, not just claimed by a
+// consumer still copying out of it
+static bool mpmcWritable(struct mailslot_mpmc *q)
+{
+	unsigned long pos = READ_ONCE(q->enqueue);
+
+	return (long)(smp_load_acquire(&slotAt(q, pos)->seq) - pos) >= 0;
+}
+
+// Ring bytes the staged messages take once flushed, 0 if none. Racy,
+// for fit checks.
+static size_t stageNeed(struct mailslot *ms)
+{
+	size_t ttl = READ_ONCE(ms->eng.ttl) ? sizeof(__u64) : 0;
+	size_t need = 0;
+	int cpu;
+
+	if (!ms->stage)
+		return 0;
+
+	for_each_possible_cpu(cpu)
+	{
+		struct mailslot_stage *st = per_cpu_ptr(ms->stage, cpu);
+		unsigned int n = READ_ONCE(st->count);
+
+		if (n)
+			need += READ_ONCE(st->need) + n * ttl;
+	}
+	return need;
+}
+
+// Room for one message per iovec at "priority". In staged mode priority 0
+// messages queue up behind the staged ones, which count as queued, plus
+// one padding record for wrapping anywhere among them.
+static bool writeFits(struct mailslot *ms, int priority, const struct iovec *iov, unsigned int count)
+{
+	struct mailslot_mpmc *q = READ_ONCE(ms->mpmc);
+	size_t staged;
+
+	if (priority)
+		return READ_ONCE(ms->urgent_bytes) + urgentNeed(iov, count) <= MAX_URGENT_BYTES;
+	// One message at a time, batches are refused in MPMC mode
+	if (q && READ_ONCE(ms->mode) == MAILSLOT_MODE_MPMC)
+		return mpmcWritable(q);
+	if (READ_ONCE(ms->mode) == MAILSLOT_MODE_STAGED && (staged = stageNeed(ms)))
+		return ringUsed(ms) + staged + batchNeed(ms, iov, count) +
+		       MAILSLOT_RECORD_SIZE(sizeof(__u64) + max_t(size_t, ms->eng.inline_max, STAGE_MSG_MAX)) <= ms->eng.size &&
+		       largeFits(ms, largeNeed(ms, iov, count));
+	return ringFits(ms, iov, count);
+}
+
+// Highest priority message queued above priority 0, found in O(1) through
+// urgent_mask. Caller holds the mutex and checked urgent_mask.
+static struct mailslot_urgent *urgentFirst(struct mailslot *ms)
+{
+	return list_first_entry(&ms->urgent[__fls(ms->urgent_mask) - 1], struct mailslot_urgent, node);
+}
+
+static void urgentRemove(struct mailslot *ms, int priority, struct mailslot_urgent *msg)
+{
+	list_del(&msg->node);
+	if (list_empty(&ms->urgent[priority - 1]))
+		__clear_bit(priority, &ms->urgent_mask);
+	WRITE_ONCE(ms->urgent_bytes, ms->urgent_bytes - sizeof(*msg) - msg->len);
+	kfree(msg);
+}
+
+// Remove the message returned by urgentFirst()
+static void urgentDrop(struct mailslot *ms)
+{
+	urgentRemove(ms, __fls(ms->urgent_mask), urgentFirst(ms));
+}
+
+// Drop the expired messages at the front of every priority queue.
+// Returns whether any was dropped. Caller holds the mutex.
+static bool urgentExpire(struct mailslot *ms)
+{
+	unsigned int dropped = 0;
+	int priority;
+
+	for (priority = 1; priority < MAILSLOT_PRIORITIES; priority++)
+	{
+		struct mailslot_urgent *msg, *tmp;
+
+		list_for_each_entry_safe(msg, tmp, &ms->urgent[priority - 1], node)
+		{
+			if (!isExpired(msg->expires))
+				break;
+			urgentRemove(ms, priority, msg);
+			dropped++;
+		}
+	}
+
+	this_cpu_add(ms->stats->expired, dropped);
+	return dropped > 0;
+}
+
+// Start a record of "len" bytes at "*tail", see mailslot_record_reserve()
+static struct mailslot_record *ringReserve(struct mailslot *ms, unsigned int *tail, size_t len)
+{
+	return mailslot_record_reserve(ms->eng.ring, ms->eng.size, tail, len);
+}
+
+// Locate the message at "head", stepping over a padding record. A
+// malformed record (user space can write them) yields -EIO.
+static int ringPeek(struct mailslot *ms, unsigned int head, unsigned int tail, struct mailslot_view *v)
+{
+	return mailslot_engine_peek(&ms->eng, head, tail, v);
+}
+
+static void largeFree(struct mailslot *ms, u32 id)
+{
+	mailslot_engine_large_free(&ms->eng, id);
+}
+
+// Free the out-of-line payloads of the records in [from, to): written but
+// never published, or reclaimed
+static void ringDiscard(struct mailslot *ms, unsigned int from, unsigned int to)
+{
+	mailslot_engine_discard(&ms->eng, from, to);
+}
+
+// Ring geometry: a power-of-two byte ring within the limits that can always
+// take the largest record, even when it has to wrap
+static bool validGeometry(unsigned int size, unsigned int max_msg, unsigned int inline_max)
+{
+	size_t largest = max_msg;
+
+	if (max_msg > inline_max)
+		largest = max_t(size_t, inline_max, sizeof(struct mailslot_external));
+
+	// Leave room for an expiry, a time to live can be set at any time
+	return max_msg > 0 && max_msg <= MAX_MESSAGE_SIZE &&
+	       size <= MAX_RING_BYTES && is_power_of_2(size) &&
+	       2 * MAILSLOT_RECORD_SIZE(sizeof(__u64) + largest) <= size;
+}
+
+static void setRing(struct mailslot *ms, struct mailslot_ring_hdr *hdr)
+{
+	mailslot_engine_set_ring(&ms->eng, hdr);
+}
+
+static bool isBroadcast(int mode)
+{
+	return mode == MAILSLOT_MODE_BROADCAST || mode == MAILSLOT_MODE_BROADCAST_DROP;
+}
+
+// Engines whose readers all take the mutex, and so can serve priorities above 0
+static bool servesUrgent(int mode)
+{
+	return mode == MAILSLOT_MODE_LOCKED || mode == MAILSLOT_MODE_STAGED;
+}
+
+// Whether "mf" has a message to read: past its own cursor in broadcast
+// mode, in the slots in MPMC mode, anywhere in the ring otherwise
+static bool hasMessage(struct mailslot *ms, struct mailslot_file *mf)
+{
+	struct mailslot_mpmc *q = READ_ONCE(ms->mpmc);
+
+	if (READ_ONCE(ms->urgent_mask))
+		return true;
+	if (q && READ_ONCE(ms->mode) == MAILSLOT_MODE_MPMC)
+		return mpmcReadable(q);
+	if (isBroadcast(READ_ONCE(ms->mode)))
+		return READ_ONCE(mf->cursor) != smp_load_acquire(&ms->eng.shared->tail);
+	return ringUsed(ms) > 0;
+}
+
+// Hand back to producers the records every subscriber has read.
+// Caller holds the mutex.
+static void bcastReclaim(struct mailslot *ms)
+{
+	struct mailslot_ring_hdr *hdr = ms->eng.shared;
+	unsigned int head = READ_ONCE(hdr->head);
+	unsigned int done = smp_load_acquire(&hdr->tail) - head;
+	struct mailslot_file *mf;
+
+	// Without subscribers messages are kept for the next one
+	if (list_empty(&ms->subscribers))
+		return;
+
+	list_for_each_entry(mf, &ms->subscribers, node)
+		done = min(done, mf->cursor - head);
+	if (done == 0)
+		return;
+
+	ringDiscard(ms, head, head + done);
+	smp_store_release(&hdr->head, head + done);
+}
+
+// Move head from "old" to "head" outside the consumer path, moving along
+// the broadcast subscribers that had not read that far. Caller holds the mutex.
+static void ringAdvance(struct mailslot *ms, unsigned int old, unsigned int head)
+{
+	struct mailslot_file *mf;
+
+	list_for_each_entry(mf, &ms->subscribers, node)
+		if (mf->cursor - old < head - old)
+			WRITE_ONCE(mf->cursor, head);
+
+	smp_store_release(&ms->eng.shared->head, head);
+}
+
+// Reclaim the expired messages at the head of the ring for a writer that
+// found it full. Only consumers move head in SPSC mode or while the ring
+// is mapped, there expired messages wait to be skipped by a reader.
+// Returns whether any was dropped. Caller holds the mutex.
+static bool ringExpire(struct mailslot *ms)
+{
+	struct mailslot_ring_hdr *hdr = ms->eng.shared;
+	unsigned int old = READ_ONCE(hdr->head);
+	unsigned int tail = smp_load_acquire(&hdr->tail);
+	unsigned int head = old;
+	unsigned int dropped = 0;
+	struct mailslot_view v;
+
+	if (ms->mode == MAILSLOT_MODE_SPSC || atomic_read(&ms->mapped))
+		return false;
+
+	while (head != tail && !ringPeek(ms, head, tail, &v) && isExpired(v.expires))
+	{
+		if (v.external)
+			largeFree(ms, v.id);
+		head = v.next;
+		dropped++;
+	}
+	if (!dropped)
+		return false;
+
+	ringAdvance(ms, old, head);
+	this_cpu_add(ms->stats->expired, dropped);
+	return true;
+}
+
+// Drop-oldest policy: reclaim the oldest messages until one record per
+// iovec fits, moving broadcast subscribers that had not read them yet past
+// them. Like ringExpire(), not possible where consumers own head.
+// Caller holds the mutex.
+static void ringDrop(struct mailslot *ms, const struct iovec *iov, unsigned int count)
+{
+	struct mailslot_ring_hdr *hdr = ms->eng.shared;
+	unsigned int old = READ_ONCE(hdr->head);
+	unsigned int tail = smp_load_acquire(&hdr->tail);
+	unsigned int head = old;
+	unsigned int dropped = 0;
+	size_t large = largeNeed(ms, iov, count);
+	struct mailslot_view v;
+
+	if (ms->mode == MAILSLOT_MODE_SPSC || atomic_read(&ms->mapped))
+		return;
+
+	while (head != tail &&
+	       (tail - head + batchNeed(ms, iov, count) > ms->eng.size || !largeFits(ms, large)) &&
+	       !ringPeek(ms, head, tail, &v))
+	{
+		if (v.external)
+			largeFree(ms, v.id);
+		head = v.next;
+		dropped++;
+	}
+
+	ringAdvance(ms, old, head);
+	this_cpu_add(ms->stats->dropped_slow, dropped);
+}
+
+// Drop-oldest policy above priority 0: reclaim the oldest messages of the
+// lowest priorities, up to the writer's own, until the batch fits.
+// Caller holds the mutex.
+static void urgentDropOldest(struct mailslot *ms, int priority, const struct iovec *iov, unsigned int count)
+{
+	size_t need = urgentNeed(iov, count);
+	unsigned int dropped = 0;
+	int level;
+
+	for (level = 1; level <= priority; level++)
+		while (ms->urgent_bytes + need > MAX_URGENT_BYTES && !list_empty(&ms->urgent[level - 1]))
+		{
+			urgentRemove(ms, level, list_first_entry(&ms->urgent[level - 1], struct mailslot_urgent, node));
+			dropped++;
+		}
+
+	this_cpu_add(ms->stats->dropped_slow, dropped);
+}
+
+// Grow policy: double the ring, up to MAX_RING_BYTES, copying the queued
+// records (without padding) to the start of the new one. Not possible
+// while the ring is mapped or in SPSC mode, where it is used without the
+// mutex. Returns -EIO if an earlier mapping left a malformed record.
+// Caller holds the mutex.
+static int ringGrow(struct mailslot *ms)
+{
+	struct mailslot_ring_hdr *old = ms->eng.shared, *hdr;
+	unsigned int head = READ_ONCE(old->head);
+	unsigned int tail = READ_ONCE(old->tail);
+	unsigned int at, next, pos = 0;
+	struct mailslot_record rec;
+	struct mailslot_file *mf;
+	char *ring, *payload;
+
+	if (ms->mode == MAILSLOT_MODE_SPSC || atomic_read(&ms->mapped) ||
+	    ms->eng.size >= MAX_RING_BYTES)
+		return -ENOSPC;
+
+	// Offsets and records may come from a mapping that is gone by now,
+	// check them all before anything moves. Nobody can write them again
+	// until we are done: no mapping is left and mmap needs the mutex.
+	if (tail - head > ms->eng.size)
+		return -EIO;
+	for (at = head; at != tail; at = next)
+		if (!mailslot_record_find(ms->eng.ring, ms->eng.size, at, tail, &rec, &next))
+			return -EIO;
+
+	hdr = mailslot_ring_alloc(ms->eng.size * 2, ms->eng.max_msg, ms->eng.inline_max);
+	if (!hdr)
+		return -ENOMEM;
+	hdr->ttl_ms = old->ttl_ms;
+	ring = (char *)hdr + hdr->data_offset;
+
+	// Cursors are relative to head while the records move. A moved cursor
+	// never exceeds the old position of the record being copied, so it
+	// cannot match a later one.
+	list_for_each_entry(mf, &ms->subscribers, node)
+		mf->cursor -= head;
+
+	for (at = head; at != tail; at = next)
+	{
+		payload = mailslot_record_find(ms->eng.ring, ms->eng.size, at, tail, &rec, &next);
+
+		memcpy(ring + pos, &rec, sizeof(rec));
+		memcpy(ring + pos + sizeof(rec), payload, rec.len);
+		list_for_each_entry(mf, &ms->subscribers, node)
+			if (mf->cursor - (at - head) < next - at)
+				mf->cursor = pos;
+		pos += MAILSLOT_RECORD_SIZE(rec.len);
+	}
+
+	list_for_each_entry(mf, &ms->subscribers, node)
+		if (mf->cursor == tail - head)
+			mf->cursor = pos;
+	hdr->tail = pos;
+
+	// Lockless readers may still look at the old ring
+	setRing(ms, hdr);
+	synchronize_rcu();
+	mailslot_ring_free(old);
+	return 0;
+}
+
+// Effective overflow policy, the broadcast drop mode implies drop-oldest
+static int overflowPolicy(struct mailslot *ms)
+{
+	if (ms->mode == MAILSLOT_MODE_BROADCAST_DROP)
+		return MAILSLOT_OVERFLOW_DROP_OLDEST;
+	return ms->overflow;
+}
+
+// Fit check of the locked write paths. In staged mode a priority 0 write
+// must not overtake messages staged earlier on its CPU: they are flushed
+// first, and any that do not fit the ring leave it full for the writer.
+// Caller holds the mutex.
+static bool lockedFits(struct mailslot *ms, int priority, const struct iovec *iov, unsigned int count)
+{
+	if (!priority && ms->mode == MAILSLOT_MODE_STAGED)
+		stageFlushAll(ms);
+	return writeFits(ms, priority, iov, count);
+}
+
+// Make room for one message per iovec at "priority" as the overflow policy
+// says. Returns 0 once it fits, -ENOSPC if the write is rejected, -EIO if
+// the ring cannot grow over a malformed record or -EAGAIN if the writer
+// has to wait for consumers. Caller holds the mutex.
+static int makeRoom(struct mailslot *ms, int priority, const struct iovec *iov, unsigned int count)
+{
+	// The MPMC slots are not in the ring: growing or dropping it would not
+	// help, and every caller backs out of MPMC mode once it holds the lock
+	if (ms->mode == MAILSLOT_MODE_MPMC)
+		return 0;
+
+	if (lockedFits(ms, priority, iov, count))
+		return 0;
+
+	// Expired messages make room first
+	if ((priority ? urgentExpire(ms) : ringExpire(ms)) &&
+	    lockedFits(ms, priority, iov, count))
+		return 0;
+
+	switch (overflowPolicy(ms))
+	{
+	case MAILSLOT_OVERFLOW_REJECT:
+		this_cpu_inc(ms->stats->dropped_full);
+		return -ENOSPC;
+	case MAILSLOT_OVERFLOW_DROP_OLDEST:
+		if (priority)
+			urgentDropOldest(ms, priority, iov, count);
+		else
+			ringDrop(ms, iov, count);
+		break;
+	case MAILSLOT_OVERFLOW_GROW:
+		// Only the ring grows, out-of-line and urgent budgets are fixed
+		while (!priority && !writeFits(ms, priority, iov, count))
+		{
+			int err = ringGrow(ms);
+
+			if (err == -EIO)
+				return err;
+			if (err)
+				break;
+		}
+		break;
+	}
+
+	return lockedFits(ms, priority, iov, count) ? 0 : -EAGAIN;
+}
+
+// Where "mf" reads from: its own cursor in broadcast mode, the shared head otherwise
+static unsigned int readPos(struct mailslot *ms, struct mailslot_file *mf)
+{
+	return isBroadcast(ms->mode) ? mf->cursor : READ_ONCE(ms->eng.shared->head);
+}
+
+// Consume everything before "pos". In broadcast mode the records only go
+// back to producers once every subscriber is past them.
+static void readDone(struct mailslot *ms, struct mailslot_file *mf, unsigned int pos)
+{
+	if (isBroadcast(ms->mode))
+	{
+		WRITE_ONCE(mf->cursor, pos);
+		bcastReclaim(ms);
+	}
+	else
+		smp_store_release(&ms->eng.shared->head, pos);
+}
+
+// Statistics helpers, per-CPU so accounting adds no shared cache lines
+static void statsPushed(struct mailslot *ms, unsigned int count, size_t bytes, unsigned int used)
+{
+	this_cpu_add(ms->stats->pushed, count);
+	this_cpu_add(ms->stats->bytes_in, bytes);
+	if (used > this_cpu_read(ms->stats->high_water))
+		this_cpu_write(ms->stats->high_water, used);
+}
+
+static void statsPopped(struct mailslot *ms, unsigned int count, size_t bytes)
+{
+	this_cpu_add(ms->stats->popped, count);
+	this_cpu_add(ms->stats->bytes_out, bytes);
+}
+
+// Move the messages staged on one CPU into the ring, oldest first, as far
+// as they fit, and publish them with a single tail update. Their time to
+// live starts here. Returns the number moved. Caller holds the mutex.
+static unsigned int stageFlush(struct mailslot *ms, struct mailslot_stage *st)
+{
+	struct mailslot_ring_hdr *hdr = ms->eng.shared;
+	unsigned int head = smp_load_acquire(&hdr->head);
+	unsigned int tail = READ_ONCE(hdr->tail);
+	unsigned int off = 0, n = 0;
+	size_t bytes = 0;
+
+	// Records must start aligned, mmap producers may have moved tail anywhere
+	if (tail & (MAILSLOT_RECORD_ALIGN - 1))
+		return 0;
+
+	spin_lock(&st->lock);
+	while (off < st->used)
+	{
+		struct mailslot_staged *msg = (struct mailslot_staged *)(st->buf + off);
+		struct kvec kv = { .iov_base = msg->data, .iov_len = msg->len };
+		struct iov_iter from;
+
+		if (tail - head + recordNeed(ms, tail, msg->len) > ms->eng.size)
+			break;
+
+		// Staged messages are inline, recordFill() cannot fail on them
+		iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, msg->len);
+		recordFill(ms, ringReserve(ms, &tail, inlineLen(ms, msg->len)), &from, msg->len);
+		trace_mailslot_push(ms->minor, msg->len, tail - head);
+		off += STAGE_RECORD_SIZE(msg->len);
+		st->need -= MAILSLOT_RECORD_SIZE(msg->len);
+		bytes += msg->len;
+		n++;
+	}
+	memmove(st->buf, st->buf + off, st->used - off);
+	st->used -= off;
+	st->count -= n;
+	spin_unlock(&st->lock);
+
+	if (n)
+	{
+		smp_store_release(&hdr->tail, tail);
+		statsPushed(ms, n, bytes, tail - head);
+	}
+	return n;
+}
+
+// Flush every CPU's staging buffer. Caller holds the mutex.
+static unsigned int stageFlushAll(struct mailslot *ms)
+{
+	unsigned int n = 0;
+	int cpu;
+
+	if (!ms->stage)
+		return 0;
+
+	for_each_possible_cpu(cpu)
+	{
+		struct mailslot_stage *st = per_cpu_ptr(ms->stage, cpu);
+
+		if (READ_ONCE(st->used))
+			n += stageFlush(ms, st);
+	}
+	return n;
+}
+
+// Whether messages wait in a staging buffer. Racy, for teardown decisions.
+static bool stageBusy(struct mailslot *ms)
+{
+	int cpu;
+
+	if (!ms->stage)
+		return false;
+
+	for_each_possible_cpu(cpu)
+		if (READ_ONCE(per_cpu_ptr(ms->stage, cpu)->used))
+			return true;
+	return false;
+}
+
+// Deferred flush, so staged messages reach readers even when writers stop
+static void stageWork(struct work_struct *work)
+{
+	struct mailslot *ms = container_of(to_delayed_work(work), struct mailslot, stage_work);
+	unsigned int n;
+
+	mutex_lock(&ms->mutex);
+	n = stageFlushAll(ms);
+	mutex_unlock(&ms->mutex);
+
+	if (n)
+		wake_up_interruptible(&ms->readq);
+}
+
+// Take the instance mutex, counting contention
+static int lockInstance(struct mailslot *ms)
+{
+	if (mutex_trylock(&ms->mutex))
+		return 0;
+
+	this_cpu_inc(ms->stats->contended);
+	return mutex_lock_interruptible(&ms->mutex) ? -ERESTARTSYS : 0;
+}
+
+// Wait conditions. Before reporting "not ready" they flag the sleeper in the
+// shared header, so producers/consumers working on the mapping know they
+// have to issue MAILSLOT_IOC_WAKE.
+// They run without the instance locks, RCU keeps a replaced ring alive.
+static int readReady(struct mailslot *ms, struct mailslot_file *mf)
+{
+	int ready;
+
+	rcu_read_lock();
+	ready = hasMessage(ms, mf);
+	if (!ready)
+	{
+		WRITE_ONCE(ms->eng.shared->reader_waiting, 1);
+		smp_mb();	// Flag before re-checking tail, pairs with mmap producers
+		ready = hasMessage(ms, mf);
+	}
+	rcu_read_unlock();
+	return ready;
+}
+
+static int writeReady(struct mailslot *ms, int priority, const struct iovec *iov, unsigned int count)
+{
+	int ready;
+
+	rcu_read_lock();
+	ready = writeFits(ms, priority, iov, count);
+	if (!ready)
+	{
+		WRITE_ONCE(ms->eng.shared->writer_waiting, 1);
+		smp_mb();	// Flag before re-checking head, pairs with mmap consumers
+		ready = writeFits(ms, priority, iov, count);
+	}
+	rcu_read_unlock();
+	return ready;
+}
+
+// Lock the instance before its readers/writers or mode change. In SPSC
+// mode the fast paths run without the mutex, so they are drained through
+// fast_sem first. Returns whether fast_sem was taken.
+static bool lockTopology(struct mailslot *ms)
+{
+	for (;;)
+	{
+		bool spsc = READ_ONCE(ms->mode) == MAILSLOT_MODE_SPSC;
+
+		if (spsc)
+			percpu_down_write(&ms->fast_sem);
+		mutex_lock(&ms->mutex);
+
+		// Mode switched to SPSC in between, retry draining the fast paths
+		if (spsc || ms->mode != MAILSLOT_MODE_SPSC)
+			return spsc;
+		mutex_unlock(&ms->mutex);
+	}
+}
+
+static void unlockTopology(struct mailslot *ms, bool spsc)
+{
+	mutex_unlock(&ms->mutex);
+	if (spsc)
+		percpu_up_write(&ms->fast_sem);
+}
+
+// Enter the lock-free path for one side of the instance ("users" points to
+// the reader or writer count, "side" is SPSC_READER or SPSC_WRITER).
+// Succeeds, with fast_sem held for read, only in SPSC mode while the
+// caller is the single descriptor of that side. Threads or forked children
+// share that descriptor, so the side is also owned bit-wise: a second
+// caller gets false and takes the mutex path, which waits for the owner
+// (spscClaim()). Left with spscExit().
+static bool spscEnter(struct mailslot *ms, int *users, int side)
+{
+	if (READ_ONCE(ms->mode) != MAILSLOT_MODE_SPSC)
+		return false;
+
+	percpu_down_read(&ms->fast_sem);
+	if (ms->mode == MAILSLOT_MODE_SPSC && *users == 1 &&
+	    !test_and_set_bit_lock(side, &ms->spsc_owner))
+		return true;
+
+	percpu_up_read(&ms->fast_sem);
+	return false;
+}
+
+static void spscRelease(struct mailslot *ms, int side)
+{
+	clear_bit_unlock(side, &ms->spsc_owner);
+	smp_mb__after_atomic();
+	wake_up_bit(&ms->spsc_owner, side);
+}
+
+static void spscExit(struct mailslot *ms, int side)
+{
+	spscRelease(ms, side);
+	percpu_up_read(&ms->fast_sem);
+}
+
+// The mutex paths of an SPSC instance own their side too, so they never
+// run next to a fast path caller sharing their descriptor. The owner
+// never takes the mutex, waiting for it here cannot deadlock. Caller
+// holds the mutex; returns whether the side was taken (release it with
+// spscRelease()).
+static bool spscClaim(struct mailslot *ms, int side)
+{
+	if (ms->mode != MAILSLOT_MODE_SPSC)
+		return false;
+
+	wait_on_bit_lock(&ms->spsc_owner, side, TASK_UNINTERRUPTIBLE);
+	return true;
+}
+
+// Enter the lock-free MPMC paths, with fast_sem held for read so the mode
+// and its slots stay in place
+static bool mpmcEnter(struct mailslot *ms)
+{
+	if (READ_ONCE(ms->mode) != MAILSLOT_MODE_MPMC)
+		return false;
+
+	percpu_down_read(&ms->fast_sem);
+	if (ms->mode == MAILSLOT_MODE_MPMC)
+		return true;
+
+	percpu_up_read(&ms->fast_sem);
+	return false;
+}
+
+// Slots for messages of up to "max_msg" bytes, as many as fit "size"
+// bytes (at least two), rounded down to a power of two
+static struct mailslot_mpmc *mpmcAlloc(unsigned int size, unsigned int max_msg)
+{
+	size_t slot_size = ALIGN(sizeof(struct mailslot_slot) + max_msg, sizeof(u64));
+	unsigned long nr = max_t(unsigned long, size / slot_size, 2);
+	struct mailslot_mpmc *q;
+	unsigned long i;
+
+	nr = rounddown_pow_of_two(nr);
+	if (nr * slot_size > MAX_RING_BYTES)
+		return NULL;
+
+	q = vzalloc(sizeof(*q) + nr * slot_size);
+	if (!q)
+		return NULL;
+
+	q->mask = nr - 1;
+	q->slot_size = slot_size;
+	q->max_msg = max_msg;
+	for (i = 0; i < nr; i++)
+		((struct mailslot_slot *)(q->slots + i * slot_size))->seq = i;
+	return q;
+}
+
+// Enqueue one message without locks. Returns -EAGAIN when every slot is
+// taken. Caller is inside mpmcEnter().
+static int mpmcPush(struct mailslot *ms, struct iov_iter *from, size_t len)
+{
+	struct mailslot_mpmc *q = ms->mpmc;
+	struct mailslot_slot *slot;
+	unsigned long pos = READ_ONCE(q->enqueue);
+	unsigned long seen;
+	int err = 0;
+
+	if (len > q->max_msg)
+		return -EINVAL;
+
+	// 1. Claim the slot at the enqueue position
+	for (;;)
+	{
+		long diff;
+
+		slot = slotAt(q, pos);
+		diff = (long)(smp_load_acquire(&slot->seq) - pos);
+		if (diff == 0)
+		{
+			seen = cmpxchg(&q->enqueue, pos, pos + 1);
+			if (seen == pos)
+				break;
+			pos = seen;
+		}
+		else if (diff < 0)
+			return -EAGAIN;		// Its previous message is still unread: full
+		else
+			pos = READ_ONCE(q->enqueue);
+	}
+
+	// 2. Fill it. It has to be published whatever happens, a fault
+	// leaves a dead slot readers step over.
+	slot->len = len;
+	slot->expires = ms->eng.ttl ? ktime_get_ns() + ms->eng.ttl : 0;
+	if (copy_from_iter(slot->data, len, from) != len)
+	{
+		slot->len = SLOT_DEAD;
+		err = -EFAULT;
+	}
+
+	// 3. Hand it to consumers
+	smp_store_release(&slot->seq, pos + 1);
+
+	if (!err)
+	{
+		statsPushed(ms, 1, len, mpmcUsed(q));
+		trace_mailslot_push(ms->minor, len, mpmcUsed(q));
+	}
+	return err;
+}
+
+// Dequeue one message without locks into "to", followed by a newline like
+// getMessage(). A message larger than "to" stays queued (-EINVAL); one
+// that cannot be copied out is lost (-EFAULT). Returns -EAGAIN when no
+// message is left. Caller is inside mpmcEnter().
+static int mpmcPop(struct mailslot *ms, struct iov_iter *to, size_t *ret_len)
+{
+	struct mailslot_mpmc *q = ms->mpmc;
+	struct mailslot_slot *slot;
+	unsigned long pos, seen;
+	u32 len;
+
+	for (;;)
+	{
+		bool expired = false;
+		int err = 0;
+
+		// 1. Claim the slot at the dequeue position
+		pos = READ_ONCE(q->dequeue);
+		for (;;)
+		{
+			long diff;
+
+			slot = slotAt(q, pos);
+			diff = (long)(smp_load_acquire(&slot->seq) - (pos + 1));
+			if (diff == 0)
+			{
+				// Stable until the slot is claimed, by us or a racing reader
+				len = READ_ONCE(slot->len);
+				expired = len != SLOT_DEAD && isExpired(READ_ONCE(slot->expires));
+				if (len != SLOT_DEAD && !expired && iov_iter_count(to) < len + 1)
+				{
+					pr_debug("Read buffer too small for message (%u bytes)\n", len);
+					return -EINVAL;
+				}
+
+				seen = cmpxchg(&q->dequeue, pos, pos + 1);
+				if (seen == pos)
+					break;
+				pos = seen;
+			}
+			else if (diff < 0)
+				return -EAGAIN;		// Not written yet: empty
+			else
+				pos = READ_ONCE(q->dequeue);
+		}
+
+		// 2. Copy it out, then free the slot for the producer one lap ahead
+		if (len != SLOT_DEAD && !expired)
+		{
+			if (copy_to_iter(slot->data, len, to) != len || copy_to_iter("\n", 1, to) != 1)
+				err = -EFAULT;
+		}
+		smp_store_release(&slot->seq, pos + q->mask + 1);
+
+		if (expired)
+			this_cpu_inc(ms->stats->expired);
+		if (len == SLOT_DEAD || expired)
+			continue;
+		if (err)
+			return err;
+
+		*ret_len = len;
+		statsPopped(ms, 1, len);
+		trace_mailslot_pop(ms->minor, len, mpmcUsed(q));
+		return 0;
+	}
+}
+
+// MAILSLOT_MODE_STAGED write: append a small message to this CPU's
+// staging buffer without the instance mutex. fast_sem keeps the mode from
+// changing under us. Returns -EAGAIN, with "from" untouched, when the
+// message has to take the locked path instead.
+static int stageWrite(struct mailslot *ms, struct iov_iter *from, size_t len)
+{
+	char data[STAGE_MSG_MAX];
+	struct mailslot_stage *st;
+	struct mailslot_staged *msg;
+	bool first, flush;
+
+	if (len > STAGE_MSG_MAX || len > READ_ONCE(ms->eng.inline_max))
+		return -EAGAIN;
+
+	// Fault user memory in before taking the spinlock
+	if (copy_from_iter(data, len, from) != len)
+		return -EFAULT;
+
+	percpu_down_read(&ms->fast_sem);
+	if (ms->mode != MAILSLOT_MODE_STAGED)
+		goto fallback;
+
+	// Migrating right after is harmless, the buffer has its own lock
+	st = raw_cpu_ptr(ms->stage);
+	spin_lock(&st->lock);
+	if (st->used + STAGE_RECORD_SIZE(len) > STAGE_SIZE)
+	{
+		spin_unlock(&st->lock);
+		goto fallback;
+	}
+	msg = (struct mailslot_staged *)(st->buf + st->used);
+	msg->len = len;
+	memcpy(msg->data, data, len);
+	first = st->used == 0;
+	st->used += STAGE_RECORD_SIZE(len);
+	st->count++;
+	st->need += MAILSLOT_RECORD_SIZE(len);
+	flush = st->used >= STAGE_FLUSH;
+	spin_unlock(&st->lock);
+	percpu_up_read(&ms->fast_sem);
+
+	// Batch is big enough, or make sure it gets flushed soon
+	if (flush && mutex_trylock(&ms->mutex))
+	{
+		stageFlush(ms, st);
+		mutex_unlock(&ms->mutex);
+		wake_up_interruptible(&ms->readq);
+	}
+	else if (first || flush)
+		schedule_delayed_work(&ms->stage_work, STAGE_DELAY);
+	return 0;
+
+fallback:
+	percpu_up_read(&ms->fast_sem);
+	iov_iter_revert(from, len);
+	return -EAGAIN;
+}
+
+/* Open a mailslot instance. Any number of readers and writers may share it. */
+static int mailslot_open(struct inode *inode, struct file *file)
+{
+	printk("Opening mailslot\n");
+
+	// Get minor number (device) and its instance, allocating it on first use
+	int minor = iminor(file->f_path.dentry->d_inode);
+	struct mailslot_file *mf = kzalloc(sizeof(*mf), GFP_KERNEL);
+	struct mailslot *ms;
+	bool spsc;
+
+	if (!mf)
+		return -ENOMEM;
+
+	ms = getInstance(minor);
+	if (IS_ERR(ms))
+	{
+		kfree(mf);
+		return PTR_ERR(ms);
+	}
+	mf->ms = ms;
+	file->private_data = mf;
+
+	spsc = lockTopology(ms);
+
+	// Readers subscribe from the oldest message still queued
+	if (file->f_mode & FMODE_READ)
+	{
+		ms->readers++;
+		mf->cursor = READ_ONCE(ms->eng.shared->head);
+		list_add_tail(&mf->node, &ms->subscribers);
+	}
+	if (file->f_mode & FMODE_WRITE)
+		ms->writers++;
+
+	// First opener brings the instance up
+	if (ms->opened++ == 0)
+	{
+		printk("New mailslot instance created with minor number: %d. There are %d mailslots now.\n", minor, atomic_inc_return(&instances_count));
+	}
+
+	unlockTopology(ms, spsc);
+	return 0;
+}	
+
+
+static int mailslot_release(struct inode *inode, struct file *file)
+{
+	printk("Releasing mailslot\n");
+
+	struct mailslot_file *mf = file->private_data;
+	struct mailslot *ms = mf->ms;
+	bool spsc = lockTopology(ms);
+
+	// The slowest subscriber may be leaving, reclaim what the others read
+	if (file->f_mode & FMODE_READ)
+	{
+		ms->readers--;
+		list_del(&mf->node);
+		if (isBroadcast(ms->mode))
+		{
+			bcastReclaim(ms);
+			wake_up_interruptible(&ms->writeq);
+		}
+	}
+	if (file->f_mode & FMODE_WRITE)
+		ms->writers--;
+
+	// Last closer releases the instance, queued messages are kept
+	if (--ms->opened == 0)
+	{
+		stageFlushAll(ms);
+		atomic_dec(&instances_count);
+		clearMailslot(ms);
+		printk("Successfully closed mailslot with minor number: %d\n",ms->minor);
+	}
+
+	unlockTopology(ms, spsc);
+	kfree(mf);
+
+	// Frees the instance if it is idle and empty
+	putInstance(ms);
+	return 0;
+}
+
+// Take the instance mutex once the mailslot holds a message.
+// Sleeps unless the file is O_NONBLOCK; returns with the mutex held on success.
+static int lockForRead(struct file *filp, struct mailslot *ms)
+{
+	struct mailslot_file *mf = filp->private_data;
+
+	for (;;)
+	{
+		if (lockInstance(ms))
+			return -ERESTARTSYS;
+
+		if (hasMessage(ms, mf))
+			return 0;
+
+		// Nothing in the ring, staged messages may be waiting
+		if (stageFlushAll(ms) && hasMessage(ms, mf))
+			return 0;
+
+		mutex_unlock(&ms->mutex);
+		trace_mailslot_empty(ms->minor);
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(ms->readq, readReady(ms, mf)))
+			return -ERESTARTSYS;
+	}
+}
+
+// Take the instance mutex once the mailslot has room for one message per iovec
+// at the priority of the file, applying the overflow policy when it is full.
+// Sleeps unless the file is O_NONBLOCK; returns with the mutex held on success.
+static int lockForWrite(struct file *filp, struct mailslot *ms, const struct iovec *iov, unsigned int count)
+{
+	struct mailslot_file *mf = filp->private_data;
+	int err;
+
+	for (;;)
+	{
+		if (lockInstance(ms))
+			return -ERESTARTSYS;
+
+		err = makeRoom(ms, mf->priority, iov, count);
+		if (err != -EAGAIN)
+		{
+			if (err)
+			{
+				mutex_unlock(&ms->mutex);
+				trace_mailslot_full(ms->minor);
+			}
+			return err;
+		}
+
+		mutex_unlock(&ms->mutex);
+		trace_mailslot_full(ms->minor);
+
+		if (filp->f_flags & O_NONBLOCK)
+		{
+			this_cpu_inc(ms->stats->dropped_full);
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(ms->writeq, writeReady(ms, mf->priority, iov, count)))
+			return -ERESTARTSYS;
+	}
+}
+
+/* Read from desired mailslot. Each message gets removed when consumed.
+ * Sleeps until a message is available unless the file is O_NONBLOCK.
+ * Also backs splice()/sendfile() from the mailslot, one message per call. */
+static ssize_t mailslot_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	int err;
+
+	// 1. Get instance (bound at open)
+	struct file *filp = iocb->ki_filp;
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot *ms = mf->ms;
+	size_t ret_len;
+	bool claimed;
+
+retry:
+	// MPMC engine: any number of consumers, no mutex
+	while (mpmcEnter(ms))
+	{
+		err = mpmcPop(ms, to, &ret_len);
+		percpu_up_read(&ms->fast_sem);
+
+		if (err != -EAGAIN)
+		{
+			if (wq_has_sleeper(&ms->writeq))
+				wake_up_interruptible(&ms->writeq);
+			return err ? err : ret_len+1;
+		}
+		trace_mailslot_empty(ms->minor);
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(ms->readq, readReady(ms, mf)))
+			return -ERESTARTSYS;
+	}
+
+	// SPSC fast path: sole consumer, no mutex
+	while (spscEnter(ms, &ms->readers, SPSC_READER))
+	{
+		if (ringUsed(ms) > 0)
+		{
+			err = getMessage(ms,mf,to,&ret_len);
+			spscExit(ms, SPSC_READER);
+
+			if (err && err != -EAGAIN)
+				return err;
+			if (wq_has_sleeper(&ms->writeq))
+				wake_up_interruptible(&ms->writeq);
+			if (!err)
+				return ret_len+1;
+
+			// Only expired messages were queued
+			if (filp->f_flags & O_NONBLOCK)
+				return err;
+			continue;
+		}
+		spscExit(ms, SPSC_READER);
+		trace_mailslot_empty(ms->minor);
+
+		if (filp->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		if (wait_event_interruptible(ms->readq, readReady(ms, mf)))
+			return -ERESTARTSYS;
+	}
+	
+	// 2. Get the lock on current mailslot once it holds a message
+again:
+	err = lockForRead(filp, ms);
+	if (err)
+		return err;
+
+	// Switched to the MPMC engine while waiting
+	if (ms->mode == MAILSLOT_MODE_MPMC)
+	{
+		mutex_unlock(&ms->mutex);
+		goto retry;
+	}
+
+	// 3. Get message (expired ones are dropped on the way)
+	claimed = spscClaim(ms, SPSC_READER);
+	err = getMessage(ms,mf,to,&ret_len);
+	
+	// 4. Unlock mutex
+	if (claimed)
+		spscRelease(ms, SPSC_READER);
+	mutex_unlock(&ms->mutex);
+
+	if (err && err != -EAGAIN)
+		return err;
+
+	// 5. Room was freed, let blocked writers in
+	wake_up_interruptible(&ms->writeq);
+
+	// Only expired messages were queued, wait for a fresh one
+	if (err)
+	{
+		if (filp->f_flags & O_NONBLOCK)
+			return err;
+		goto again;
+	}
+
+	return ret_len+1;
+}
+
+/* Write on desired mailslot.
+ * When it is full the overflow policy applies: by default it sleeps until
+ * there is room unless the file is O_NONBLOCK.
+ * Also backs splice() into the mailslot, each call enqueues one message. */
+static ssize_t mailslot_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+	int err;
+
+	// 1. Get instance (bound at open)
+	struct file *filp = iocb->ki_filp;
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot *ms = mf->ms;
+	size_t len = iov_iter_count(from);
+	struct iovec iov = { .iov_len = len };	// Room needed, see ringFits()
+	bool claimed;
+
+	if (len > READ_ONCE(ms->eng.max_msg))
+	{
+		pr_debug("Message too long (%zu bytes), max is %u\n", len, ms->eng.max_msg);
+		return -EINVAL;
+	}
+
+	// Above priority 0 it could never fit the urgent budget and would wait
+	// forever (after dropping everything below it); writeBatch() rejects it too
+	if (mf->priority && urgentNeed(&iov, 1) > MAX_URGENT_BYTES)
+		return -EINVAL;
+
+retry:
+	// MPMC engine: any number of producers, no mutex. Priorities are not
+	// served, as in the other modes without urgent queues.
+	while (mpmcEnter(ms))
+	{
+		err = mf->priority ? -EINVAL : mpmcPush(ms, from, len);
+		percpu_up_read(&ms->fast_sem);
+
+		if (err != -EAGAIN)
+		{
+			// Also after a fault, readers have a dead slot to step over
+			if (err != -EINVAL && wq_has_sleeper(&ms->readq))
+				wake_up_interruptible(&ms->readq);
+			return err ? err : len;
+		}
+		trace_mailslot_full(ms->minor);
+
+		// Slots cannot be dropped or grown under lock-free consumers
+		if (READ_ONCE(ms->overflow) == MAILSLOT_OVERFLOW_REJECT)
+		{
+			this_cpu_inc(ms->stats->dropped_full);
+			return -ENOSPC;
+		}
+
+		if (filp->f_flags & O_NONBLOCK)
+		{
+			this_cpu_inc(ms->stats->dropped_full);
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(ms->writeq, writeReady(ms, 0, &iov, 1)))
+			return -ERESTARTSYS;
+	}
+
+	// SPSC fast path: sole producer, no mutex
+	while (mf->priority == 0 && spscEnter(ms, &ms->writers, SPSC_WRITER))
+	{
+		if (ringFits(ms, &iov, 1))
+		{
+			err = pushMessage(ms,from,len);
+			spscExit(ms, SPSC_WRITER);
+
+			if (err)
+				return err;
+			if (wq_has_sleeper(&ms->readq))
+				wake_up_interruptible(&ms->readq);
+			return len;
+		}
+		spscExit(ms, SPSC_WRITER);
+		trace_mailslot_full(ms->minor);
+
+		// The other policies need the mutex, here the writer waits
+		if (READ_ONCE(ms->overflow) == MAILSLOT_OVERFLOW_REJECT)
+		{
+			this_cpu_inc(ms->stats->dropped_full);
+			return -ENOSPC;
+		}
+
+		if (filp->f_flags & O_NONBLOCK)
+		{
+			this_cpu_inc(ms->stats->dropped_full);
+			return -EAGAIN;
+		}
+
+		if (wait_event_interruptible(ms->writeq, writeReady(ms, 0, &iov, 1)))
+			return -ERESTARTSYS;
+	}
+	
+	// Staged mode: small messages go to this CPU's buffer, no mutex
+	if (mf->priority == 0 && READ_ONCE(ms->mode) == MAILSLOT_MODE_STAGED)
+	{
+		err = stageWrite(ms, from, len);
+		if (err != -EAGAIN)
+			return err ? err : len;
+	}
+
+	// 2. Get the lock on current mailslot once the message fits
+	err = lockForWrite(filp, ms, &iov, 1);
+	if (err)
+		return err;
+
+	// Switched to the MPMC engine while waiting
+	if (ms->mode == MAILSLOT_MODE_MPMC)
+	{
+		mutex_unlock(&ms->mutex);
+		goto retry;
+	}
+	
+	// 3. Push message to mailslot (or to its priority queue)
+	claimed = spscClaim(ms, SPSC_WRITER);
+	if (mf->priority)
+		err = pushUrgent(ms,mf->priority,from,&iov,1);
+	else
+		err = pushMessage(ms,from,len);
+
+	// 4. Release lock
+	if (claimed)
+		spscRelease(ms, SPSC_WRITER);
+	mutex_unlock(&ms->mutex);
+
+	if (err)
+		return err;
+
+	// 5. Wake up blocked readers
+	wake_up_interruptible(&ms->readq);
+
+	return len;
+}
+
+/* Report readiness: readable when a message is queued, writable when a
+ * message of the maximum size fits */
+static unsigned int mailslot_poll(struct file *filp, poll_table *wait)
+{
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot *ms = mf->ms;
+	struct iovec iov = { .iov_len = READ_ONCE(ms->eng.max_msg) };
+	unsigned int mask = 0;
+
+	poll_wait(filp, &ms->readq, wait);
+	poll_wait(filp, &ms->writeq, wait);
+
+	// Lockless snapshot, the queues are woken after every push/pop
+	// (and by MAILSLOT_IOC_WAKE for pushes/pops done on the mapping)
+	if (readReady(ms, mf))
+		mask |= POLLIN | POLLRDNORM;
+	if (writeReady(ms, mf->priority, &iov, 1))
+		mask |= POLLOUT | POLLWRNORM;
+
+	return mask;
+}
+
+// Count live mappings, the ring cannot be replaced while one exists
+static void mailslot_vm_open(struct vm_area_struct *vma)
+{
+	struct mailslot_file *mf = vma->vm_file->private_data;
+	struct mailslot *ms = mf->ms;
+
+	atomic_inc(&ms->mapped);
+}
+
+static void mailslot_vm_close(struct vm_area_struct *vma)
+{
+	struct mailslot_file *mf = vma->vm_file->private_data;
+	struct mailslot *ms = mf->ms;
+
+	atomic_dec(&ms->mapped);
+}
+
+static const struct vm_operations_struct mailslot_vm_ops =
+{
+	.open = mailslot_vm_open,
+	.close = mailslot_vm_close,
+};
+
+/* Map the instance ring (header and records) into user space */
+static int mailslot_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot *ms = mf->ms;
+	int err;
+
+	if (vma->vm_pgoff != 0)
+		return -EINVAL;
+
+	// Rejects mappings larger than the ring. The mapping holds a file
+	// reference, so the instance outlives it. Broadcast cursors live in
+	// the driver, mapped consumers could not take part, and the MPMC
+	// slots are not in the ring at all.
+	mutex_lock(&ms->mutex);
+	if (isBroadcast(ms->mode) || ms->mode == MAILSLOT_MODE_MPMC)
+		err = -EBUSY;
+	else
+		err = remap_vmalloc_range(vma, ms->eng.shared, 0);
+	if (!err)
+	{
+		vma->vm_ops = &mailslot_vm_ops;
+		atomic_inc(&ms->mapped);
+	}
+	mutex_unlock(&ms->mutex);
+
+	return err;
+}
+
+// Drain up to batch.count messages (0 = as many as fit) into batch.buf
+// under a single lock acquisition. Blocks for the first message like read().
+static long readBatch(struct file *filp, struct mailslot *ms, struct mailslot_batch __user *arg)
+{
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot_batch batch;
+	bool claimed;
+	size_t bytes;
+	int ret;
+
+	// Only readers are subscribers with a cursor, and the single reader
+	// of an SPSC instance must stay single
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	// Batches go through the ring, the MPMC slots are read one by one.
+	// Checked again under the lock, the mode may switch while waiting.
+	if (READ_ONCE(ms->mode) == MAILSLOT_MODE_MPMC)
+		return -EINVAL;
+
+	do
+	{
+		ret = lockForRead(filp, ms);
+		if (ret)
+			return ret;
+
+		if (ms->mode == MAILSLOT_MODE_MPMC)
+		{
+			mutex_unlock(&ms->mutex);
+			return -EINVAL;
+		}
+
+		// Never next to the SPSC fast consumer
+		claimed = spscClaim(ms, SPSC_READER);
+		ret = getMessages(ms, mf, u64_to_user_ptr(batch.buf), batch.len, batch.count, &bytes);
+		if (claimed)
+			spscRelease(ms, SPSC_READER);
+
+		mutex_unlock(&ms->mutex);
+
+		if (ret < 0 && ret != -EAGAIN)
+			return ret;
+
+		wake_up_interruptible(&ms->writeq);
+
+		// Only expired messages were queued
+		if (ret == -EAGAIN && (filp->f_flags & O_NONBLOCK))
+			return ret;
+	} while (ret == -EAGAIN);
+
+	batch.count = ret;
+	batch.bytes = bytes;
+	if (copy_to_user(arg, &batch, sizeof(batch)))
+		return -EFAULT;
+
+	return ret;
+}
+
+// Enqueue every iovec of the batch as its own message, all or nothing,
+// under a single lock acquisition. Blocks until the whole batch fits.
+static long writeBatch(struct file *filp, struct mailslot *ms, struct mailslot_iov_batch __user *arg)
+{
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot_iov_batch batch;
+	struct iovec fast_iov[UIO_FASTIOV];
+	struct iovec *iov = fast_iov;
+	unsigned int size = READ_ONCE(ms->eng.size);
+	unsigned int i, largest = 0;
+	size_t total = 0, large = 0;
+	bool claimed;
+	long ret;
+
+	// Writing needs a descriptor the device node allowed to write
+	if (!(filp->f_mode & FMODE_WRITE))
+		return -EBADF;
+	if (copy_from_user(&batch, arg, sizeof(batch)))
+		return -EFAULT;
+
+	if (batch.iovcnt == 0)
+		return 0;
+	if (batch.iovcnt > UIO_MAXIOV)
+		return -EINVAL;
+	// No batches into the MPMC slots, checked again under the lock
+	if (READ_ONCE(ms->mode) == MAILSLOT_MODE_MPMC)
+		return -EINVAL;
+
+	// 1. Fetch the iovec array (on stack for small batches)
+	if (batch.iovcnt > UIO_FASTIOV)
+	{
+		iov = kmalloc_array(batch.iovcnt, sizeof(*iov), GFP_KERNEL);
+		if (!iov)
+			return -ENOMEM;
+	}
+	if (copy_from_user(iov, u64_to_user_ptr(batch.iov), batch.iovcnt * sizeof(*iov)))
+	{
+		ret = -EFAULT;
+		goto out;
+	}
+
+	for (i = 0; i < batch.iovcnt; i++)
+	{
+		if (iov[i].iov_len > READ_ONCE(ms->eng.max_msg))
+		{
+			pr_debug("Message too long (%zu bytes), max is %u\n", iov[i].iov_len, ms->eng.max_msg);
+			ret = -EINVAL;
+			goto out;
+		}
+		total += MAILSLOT_RECORD_SIZE(inlineLen(ms, iov[i].iov_len));
+		largest = max_t(unsigned int, largest, MAILSLOT_RECORD_SIZE(inlineLen(ms, iov[i].iov_len)));
+	}
+	large = largeNeed(ms, iov, batch.iovcnt);
+
+	// A batch wraps at most once, so this bound guarantees it fits an empty ring
+	if (mf->priority ? urgentNeed(iov, batch.iovcnt) > MAX_URGENT_BYTES :
+	    total + largest > size || large > MAILSLOT_MAX_LARGE_BYTES)
+	{
+		ret = -EINVAL;
+		goto out;
+	}
+
+	// 2. Wait for room for the whole batch, then push it
+	ret = lockForWrite(filp, ms, iov, batch.iovcnt);
+	if (ret)
+		goto out;
+
+	claimed = spscClaim(ms, SPSC_WRITER);
+	if (ms->mode == MAILSLOT_MODE_MPMC)
+		ret = -EINVAL;
+	else if (mf->priority)
+	{
+		struct iov_iter from;
+
+		iov_iter_init(&from, ITER_SOURCE, iov, batch.iovcnt, iov_length(iov, batch.iovcnt));
+		ret = pushUrgent(ms, mf->priority, &from, iov, batch.iovcnt);
+	}
+	else
+		ret = pushMessages(ms, iov, batch.iovcnt);
+	if (claimed)
+		spscRelease(ms, SPSC_WRITER);
+
+	mutex_unlock(&ms->mutex);
+
+	if (ret == 0)
+	{
+		wake_up_interruptible(&ms->readq);
+		ret = batch.iovcnt;
+	}
+
+out:
+	if (iov != fast_iov)
+		kfree(iov);
+	return ret;
+}
+
+// Find the "index"-th message "mf" would read next, in priority order.
+// Caller excludes consumers (mutex, or SPSC fast path as the sole reader).
+static int findMessage(struct mailslot *ms, struct mailslot_file *mf, unsigned int index, const char **data, size_t *len)
+{
+	struct mailslot_ring_hdr *hdr = ms->eng.shared;
+	unsigned int head = readPos(ms, mf);
+	unsigned int tail = smp_load_acquire(&hdr->tail);
+	struct mailslot_urgent *msg;
+	struct mailslot_view v;
+	int priority;
+
+	for (priority = MAILSLOT_PRIORITIES - 1; priority > 0; priority--)
+		list_for_each_entry(msg, &ms->urgent[priority - 1], node)
+			if (!isExpired(msg->expires) && index-- == 0)
+			{
+				*data = msg->data;
+				*len = msg->len;
+				return 0;
+			}
+
+	for (;;)
+	{
+		if (head == tail)
+			return -EAGAIN;
+		if (ringPeek(ms, head, tail, &v))
+			return -EIO;
+		if (!isExpired(v.expires) && index-- == 0)
+			break;
+		head = v.next;
+	}
+
+	*data = v.data;
+	*len = v.len;
+	return 0;
+}
+
+// Copy (the start of) a queued message to user space without consuming it.
+// Never blocks. Returns the message length.
+static long peekMessage(struct file *filp, struct mailslot *ms, struct mailslot_peek __user *arg)
+{
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot_peek peek;
+	const char *data;
+	size_t len;
+	bool fast, claimed;
+	long ret;
+
+	if (!(filp->f_mode & FMODE_READ))
+		return -EBADF;
+	if (copy_from_user(&peek, arg, sizeof(peek)))
+		return -EFAULT;
+
+	// Peeking is a consumer operation: lock out the other consumers,
+	// the SPSC fast one included
+	fast = spscEnter(ms, &ms->readers, SPSC_READER);
+	if (!fast && lockInstance(ms))
+		return -ERESTARTSYS;
+	claimed = !fast && spscClaim(ms, SPSC_READER);
+
+	// MPMC slots are claimed by consumers as a whole, they cannot be peeked
+	if (!fast && ms->mode == MAILSLOT_MODE_MPMC)
+		ret = -EINVAL;
+	else
+		ret = findMessage(ms, mf, peek.index, &data, &len);
+	if (!ret)
+	{
+		peek.msg_len = len;
+		if (copy_to_user(u64_to_user_ptr(peek.buf), data, min_t(size_t, len, peek.len)))
+			ret = -EFAULT;
+	}
+
+	if (fast)
+		spscExit(ms, SPSC_READER);
+	else
+	{
+		if (claimed)
+			spscRelease(ms, SPSC_READER);
+		mutex_unlock(&ms->mutex);
+	}
+
+	if (ret)
+		return ret;
+	if (copy_to_user(arg, &peek, sizeof(peek)))
+		return -EFAULT;
+	return len;
+}
+
+// Set the time to live of the messages written from now on, in
+// milliseconds (0 = forever). Queued messages keep their expiry.
+static long setTtl(struct mailslot *ms, unsigned long ttl_ms)
+{
+	bool spsc;
+
+	if (ttl_ms > U32_MAX)
+		return -EINVAL;
+
+	// Record sizes depend on it, keep it stable for the writers
+	spsc = lockTopology(ms);
+	ms->eng.ttl = (u64)ttl_ms * NSEC_PER_MSEC;
+	WRITE_ONCE(ms->eng.shared->ttl_ms, ttl_ms);
+	unlockTopology(ms, spsc);
+
+	return 0;
+}
+
+// Choose what writers do when the instance is full
+static long setOverflow(struct mailslot *ms, unsigned long policy)
+{
+	if (policy != MAILSLOT_OVERFLOW_BLOCK && policy != MAILSLOT_OVERFLOW_REJECT &&
+	    policy != MAILSLOT_OVERFLOW_DROP_OLDEST && policy != MAILSLOT_OVERFLOW_GROW)
+		return -EINVAL;
+
+	mutex_lock(&ms->mutex);
+	WRITE_ONCE(ms->overflow, policy);
+	mutex_unlock(&ms->mutex);
+
+	// Waiting writers may now drop, grow or fail
+	wake_up_interruptible(&ms->writeq);
+	return 0;
+}
+
+// Switch between the locked, SPSC, broadcast and staged engines. All share
+// the ring and its acquire/release indices, so queued messages are kept:
+// subscribers start from the oldest one, and leaving broadcast mode
+// resumes from the slowest subscriber. Staged messages must fit the ring
+// before the staged engine can be left. The MPMC engine has slots of its
+// own, it is only entered and left while nothing is queued.
+static long setMode(struct mailslot *ms, unsigned long mode)
+{
+	struct mailslot_stage __percpu *stage = NULL;
+	struct mailslot_mpmc *q = NULL;
+	struct mailslot_file *mf;
+	long ret = 0;
+	int cpu;
+
+	if (mode != MAILSLOT_MODE_LOCKED && mode != MAILSLOT_MODE_SPSC &&
+	    mode != MAILSLOT_MODE_STAGED && mode != MAILSLOT_MODE_MPMC && !isBroadcast(mode))
+		return -EINVAL;
+
+	// Slots sized for the current geometry, which is fixed in MPMC mode
+	if (mode == MAILSLOT_MODE_MPMC && READ_ONCE(ms->mode) != mode)
+	{
+		q = mpmcAlloc(READ_ONCE(ms->eng.size), READ_ONCE(ms->eng.max_msg));
+		if (!q)
+			return -ENOMEM;
+	}
+
+	// Staging buffers are only paid for by the instances using them
+	if (mode == MAILSLOT_MODE_STAGED && !READ_ONCE(ms->stage))
+	{
+		stage = alloc_percpu(struct mailslot_stage);
+		if (!stage)
+			return -ENOMEM;
+		for_each_possible_cpu(cpu)
+			spin_lock_init(&per_cpu_ptr(stage, cpu)->lock);
+	}
+
+	percpu_down_write(&ms->fast_sem);
+	mutex_lock(&ms->mutex);
+	if (stage && !ms->stage)
+	{
+		ms->stage = stage;
+		stage = NULL;
+	}
+	stageFlushAll(ms);
+
+	if ((isBroadcast(mode) && atomic_read(&ms->mapped)) ||
+	    (!servesUrgent(mode) && ms->urgent_mask) ||
+	    (mode != MAILSLOT_MODE_STAGED && stageBusy(ms)) ||
+	    (mode == MAILSLOT_MODE_MPMC && ms->mode != mode &&
+	     (!q || atomic_read(&ms->mapped) || ringUsed(ms) > 0)) ||
+	    (ms->mode == MAILSLOT_MODE_MPMC && mode != ms->mode && mpmcUsed(ms->mpmc)))
+		ret = -EBUSY;
+	else
+	{
+		if (isBroadcast(mode) && !isBroadcast(ms->mode))
+			list_for_each_entry(mf, &ms->subscribers, node)
+				WRITE_ONCE(mf->cursor, READ_ONCE(ms->eng.shared->head));
+
+		// Fresh slots on entry, the old ones may be sized for another geometry
+		if (mode == MAILSLOT_MODE_MPMC && ms->mode != mode)
+			swap(q, ms->mpmc);
+		ms->mode = mode;
+	}
+	mutex_unlock(&ms->mutex);
+	percpu_up_write(&ms->fast_sem);
+	free_percpu(stage);
+
+	// Lockless readiness checks may still look at the slots that lost
+	if (q)
+	{
+		synchronize_rcu();
+		vfree(q);
+	}
+
+	// Flushed messages, and writers waiting for room may be let in by the drop policy
+	wake_up_interruptible(&ms->readq);
+	wake_up_interruptible(&ms->writeq);
+	return ret;
+}
+
+// Resize the ring of an instance. Only allowed while the caller is its
+// sole user and nothing is queued or mapped.
+static long setGeometry(struct mailslot *ms, struct mailslot_geometry __user *arg)
+{
+	struct mailslot_geometry geo;
+	struct mailslot_ring_hdr *hdr;
+	long ret = 0;
+	bool spsc;
+
+	if (copy_from_user(&geo, arg, sizeof(geo)))
+		return -EFAULT;
+	if (!validGeometry(geo.ring_size, geo.max_message_size, geo.inline_size))
+		return -EINVAL;
+
+	hdr = mailslot_ring_alloc(geo.ring_size, geo.max_message_size, geo.inline_size);
+	if (!hdr)
+		return -ENOMEM;
+
+	spsc = lockTopology(ms);
+	if (ms->opened > 1 || atomic_read(&ms->mapped) || ringUsed(ms) > 0 || stageBusy(ms) ||
+	    ms->mode == MAILSLOT_MODE_MPMC)
+		ret = -EBUSY;
+	else
+	{
+		struct mailslot_ring_hdr *old = ms->eng.shared;
+		struct mailslot_file *mf;
+
+		setRing(ms, hdr);
+		ms->eng.shared->ttl_ms = old->ttl_ms;
+		hdr = old;
+		list_for_each_entry(mf, &ms->subscribers, node)
+			mf->cursor = 0;
+	}
+	unlockTopology(ms, spsc);
+
+	// Free the ring that lost (the old one once lockless readers are done)
+	if (!ret)
+		synchronize_rcu();
+	mailslot_ring_free(hdr);
+
+	return ret;
+}
+
+static long getGeometry(struct mailslot *ms, struct mailslot_geometry __user *arg)
+{
+	struct mailslot_geometry geo = { 0 };
+
+	mutex_lock(&ms->mutex);
+	geo.ring_size = ms->eng.size;
+	geo.max_message_size = ms->eng.max_msg;
+	geo.inline_size = ms->eng.inline_max;
+	mutex_unlock(&ms->mutex);
+
+	return copy_to_user(arg, &geo, sizeof(geo)) ? -EFAULT : 0;
+}
+
+static long mailslot_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+	struct mailslot_file *mf = filp->private_data;
+	struct mailslot *ms = mf->ms;
+
+	switch (cmd)
+	{
+	case MAILSLOT_IOC_READ_BATCH:
+		return readBatch(filp, ms, (struct mailslot_batch __user *)arg);
+	case MAILSLOT_IOC_WRITE_BATCH:
+		return writeBatch(filp, ms, (struct mailslot_iov_batch __user *)arg);
+	case MAILSLOT_IOC_SET_MODE:
+		return setMode(ms, arg);
+	case MAILSLOT_IOC_SET_GEOMETRY:
+		return setGeometry(ms, (struct mailslot_geometry __user *)arg);
+	case MAILSLOT_IOC_GET_GEOMETRY:
+		return getGeometry(ms, (struct mailslot_geometry __user *)arg);
+	case MAILSLOT_IOC_SET_TTL:
+		return setTtl(ms, arg);
+	case MAILSLOT_IOC_SET_OVERFLOW:
+		return setOverflow(ms, arg);
+	case MAILSLOT_IOC_PEEK:
+		return peekMessage(filp, ms, (struct mailslot_peek __user *)arg);
+	case MAILSLOT_IOC_SET_PRIORITY:
+		if (arg >= MAILSLOT_PRIORITIES)
+			return -EINVAL;
+		WRITE_ONCE(mf->priority, arg);
+		return 0;
+	case MAILSLOT_IOC_WAKE:
+		// Sleepers set their flag again if they still have to wait.
+		// The ring may grow meanwhile, RCU keeps the old one alive.
+		rcu_read_lock();
+		WRITE_ONCE(ms->eng.shared->reader_waiting, 0);
+		WRITE_ONCE(ms->eng.shared->writer_waiting, 0);
+		rcu_read_unlock();
+		wake_up_interruptible(&ms->readq);
+		wake_up_interruptible(&ms->writeq);
+		return 0;
+	default:
+		return -ENOTTY;
+	}
+}
+
+/* Module facilities */
+
+// Get message (FIFO order). Once a message is returned is also removed from its mailslot
+// (in broadcast mode, once every subscriber has read it). Returns -EAGAIN if
+// only expired messages were queued.
+// The message is copied to "to" followed by a newline, so it must hold len+1 bytes.
+// Caller holds the mutex and guarantees "mf" has a message to read.
+static int getMessage(struct mailslot *ms, struct mailslot_file *mf, struct iov_iter *to, size_t *ret_len)
+{
+	unsigned int head = readPos(ms, mf);
+	unsigned int tail = smp_load_acquire(&ms->eng.shared->tail);
+	unsigned int expired = 0;
+	int err;
+
+	// Higher priorities are served first
+	if (READ_ONCE(ms->urgent_mask))
+	{
+		urgentExpire(ms);
+		if (ms->urgent_mask)
+			return getUrgent(ms, to, ret_len);
+	}
+
+	// 1. Copy the message at head out of the ring (or its own buffer),
+	// lazily dropping expired ones. Broadcast payloads are freed once
+	// every subscriber is past them.
+	err = mailslot_engine_pop(&ms->eng, &head, tail, to, ret_len, &expired,
+				  MAILSLOT_POP_NEWLINE | (isBroadcast(ms->mode) ? MAILSLOT_POP_SHARED : 0));
+
+	// 2. Hand the bytes back to producers, expired messages are gone
+	// whatever happened to the next one
+	if (!err || expired)
+		readDone(ms, mf, head);
+	this_cpu_add(ms->stats->expired, expired);
+	if (err == -EIO)
+		pr_debug("Corrupted record at offset %u\n", head);
+	if (err == -EINVAL)
+		pr_debug("Read buffer too small for message (%zu bytes)\n", *ret_len);
+	if (err)
+		return err;
+
+	statsPopped(ms, 1, *ret_len);
+	trace_mailslot_pop(ms->minor, *ret_len, tail - head);
+	return 0;
+}
+
+// Get the highest priority message queued above priority 0, same contract
+// as getMessage(). Caller holds the mutex and checked urgent_mask.
+static int getUrgent(struct mailslot *ms, struct iov_iter *to, size_t *ret_len)
+{
+	struct mailslot_urgent *msg = urgentFirst(ms);
+
+	*ret_len = msg->len;
+	if (iov_iter_count(to) < *ret_len + 1)
+	{
+		pr_debug("Read buffer too small for message (%zu bytes)\n", *ret_len);
+		return -EINVAL;
+	}
+
+	if (copy_to_iter(msg->data,*ret_len,to) != *ret_len || copy_to_iter("\n",1,to) != 1)
+		return -EFAULT;
+
+	urgentDrop(ms);
+
+	statsPopped(ms, 1, *ret_len);
+	trace_mailslot_pop(ms->minor, *ret_len, ringUsed(ms));
+	return 0;
+}
+
+// Get up to "max" messages (0 = no limit) in FIFO order, stored back to back
+// in "buff" as MAILSLOT_BATCH_RECORD_SIZE() records, higher priorities
+// first. Stops at the first
+// message that does not fit. Returns the number of messages transferred,
+// -EAGAIN if only expired messages were queued.
+// Caller holds the mutex and guarantees "mf" has a message to read.
+static int getMessages(struct mailslot *ms, struct mailslot_file *mf, char __user *buff, size_t len, unsigned int max, size_t *bytes)
+{
+	struct mailslot_ring_hdr *hdr = ms->eng.shared;
+	unsigned int head = readPos(ms, mf);
+	unsigned int tail = smp_load_acquire(&hdr->tail);
+	unsigned int n = 0, expired = 0;
+	size_t off = 0, payload = 0;
+	int err = 0;
+
+	// Higher priorities first, the ring only once they are drained
+	if (ms->urgent_mask)
+		urgentExpire(ms);
+	while (ms->urgent_mask && (max == 0 || n < max))
+	{
+		struct mailslot_urgent *msg = urgentFirst(ms);
+
+		if (off + MAILSLOT_BATCH_RECORD_SIZE(msg->len) > len)
+		{
+			err = -EINVAL;
+			goto done;
+		}
+
+		if (put_user((__u32)msg->len, (__u32 __user *)(buff + off)) ||
+		    copy_to_user(buff + off + sizeof(__u32), msg->data, msg->len))
+		{
+			err = -EFAULT;
+			goto done;
+		}
+		off += MAILSLOT_BATCH_RECORD_SIZE(msg->len);
+		payload += msg->len;
+		trace_mailslot_pop(ms->minor, msg->len, ringUsed(ms));
+		urgentDrop(ms);
+		n++;
+	}
+
+	while (head != tail && (max == 0 || n < max))
+	{
+		struct mailslot_view v;
+
+		err = ringPeek(ms, head, tail, &v);
+		if (err)
+		{
+			pr_debug("Corrupted record at offset %u\n", head);
+			break;
+		}
+
+		// Lazily drop expired messages
+		if (isExpired(v.expires))
+		{
+			if (v.external && !isBroadcast(ms->mode))
+				largeFree(ms, v.id);
+			head = v.next;
+			expired++;
+			continue;
+		}
+
+		if (off + MAILSLOT_BATCH_RECORD_SIZE(v.len) > len)
+		{
+			err = -EINVAL;
+			break;
+		}
+
+		if (put_user((__u32)v.len, (__u32 __user *)(buff + off)) ||
+		    copy_to_user(buff + off + sizeof(__u32), v.data, v.len))
+		{
+			// Keep what was already delivered consumed
+			err = -EFAULT;
+			break;
+		}
+		if (v.external && !isBroadcast(ms->mode))
+			largeFree(ms, v.id);
+		head = v.next;
+		off += MAILSLOT_BATCH_RECORD_SIZE(v.len);
+		payload += v.len;
+		trace_mailslot_pop(ms->minor, v.len, tail - head);
+		n++;
+	}
+
+done:
+	// Release every consumed record, expired ones included, with a single
+	// offset update
+	if (n || expired)
+		readDone(ms, mf, head);
+	this_cpu_add(ms->stats->expired, expired);
+
+	if (n == 0)
+	{
+		if (err == -EINVAL)
+			pr_debug("Batch buffer too small for the first message\n");
+		return err ? err : -EAGAIN;
+	}
+
+	*bytes = off;
+
+	statsPopped(ms, n, payload);
+
+	return n;
+}
+
+// Fill a reserved record with the next "len" bytes of "from", inline or in
+// its own buffer depending on the instance threshold
+static int recordFill(struct mailslot *ms, struct mailslot_record *rec, struct iov_iter *from, size_t len)
+{
+	return mailslot_engine_fill(&ms->eng, rec, from, len);
+}
+
+// Push message into mailslot "ms".
+// Caller holds the mutex; a full mailslot is reported with -ENOSPC.
+static int pushMessage(struct mailslot *ms, struct iov_iter *from, size_t len)
+{
+	unsigned int used;
+	int err;
+
+	err = mailslot_engine_push(&ms->eng, from, len);
+	if (err == -EINVAL)
+		pr_debug("Message too long (%zu bytes), max is %u\n", len, ms->eng.max_msg);
+	if (err == -ENOSPC)
+	{
+		trace_mailslot_full(ms->minor);
+		this_cpu_inc(ms->stats->dropped_full);
+	}
+	if (err)
+		return err;
+
+	used = ringUsed(ms);
+	statsPushed(ms, 1, len, used);
+	trace_mailslot_push(ms->minor, len, used);
+	return 0;
+}
+
+// Push "count" messages, one per iovec, and publish them with a single tail
+// update so readers never observe part of the batch. Nothing is published
+// if any copy faults. Caller holds the mutex and checked lengths and space.
+static int pushMessages(struct mailslot *ms, const struct iovec *iov, unsigned int count)
+{
+	struct iov_iter from;
+	unsigned int i, used;
+	size_t bytes = 0;
+	int err;
+
+	// One iterator over the whole batch, each record consumes its iovec.
+	// Geometry may have changed since the caller validated the batch.
+	iov_iter_init(&from, ITER_SOURCE, iov, count, iov_length(iov, count));
+	err = mailslot_engine_push_batch(&ms->eng, &from, iov, count);
+	if (err == -ENOSPC)
+	{
+		trace_mailslot_full(ms->minor);
+		this_cpu_inc(ms->stats->dropped_full);
+	}
+	if (err)
+		return err;
+
+	used = ringUsed(ms);
+	for (i = 0; i < count; i++)
+	{
+		bytes += iov[i].iov_len;
+		trace_mailslot_push(ms->minor, iov[i].iov_len, used);
+	}
+	statsPushed(ms, count, bytes, used);
+	return 0;
+}
+
+// Queue one message per iovec, taken from "from", at "priority" above 0.
+// The batch is queued all or nothing. Only the locked engine serves these
+// queues. Caller holds the mutex and checked lengths.
+static int pushUrgent(struct mailslot *ms, int priority, struct iov_iter *from, const struct iovec *iov, unsigned int count)
+{
+	struct mailslot_urgent *msg, *tmp;
+	size_t need = urgentNeed(iov, count);
+	size_t bytes = 0;
+	LIST_HEAD(batch);
+	unsigned int i;
+
+	if (!servesUrgent(ms->mode))
+		return -EINVAL;
+
+	if (ms->urgent_bytes + need > MAX_URGENT_BYTES)
+	{
+		trace_mailslot_full(ms->minor);
+		this_cpu_inc(ms->stats->dropped_full);
+		return -ENOSPC;
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		int err = 0;
+
+		msg = kmalloc(struct_size(msg, data, iov[i].iov_len), GFP_KERNEL);
+		if (!msg)
+			err = -ENOMEM;
+		else if (copy_from_iter(msg->data, iov[i].iov_len, from) != iov[i].iov_len)
+			err = -EFAULT;
+		if (err)
+		{
+			kfree(msg);
+			list_for_each_entry_safe(msg, tmp, &batch, node)
+				kfree(msg);
+			return err;
+		}
+		msg->len = iov[i].iov_len;
+		msg->expires = ms->eng.ttl ? ktime_get_ns() + ms->eng.ttl : 0;
+		list_add_tail(&msg->node, &batch);
+		bytes += msg->len;
+		trace_mailslot_push(ms->minor, msg->len, ringUsed(ms));
+	}
+
+	list_splice_tail(&batch, &ms->urgent[priority - 1]);
+	__set_bit(priority, &ms->urgent_mask);
+	WRITE_ONCE(ms->urgent_bytes, ms->urgent_bytes + need);
+
+	statsPushed(ms, count, bytes, ringUsed(ms));
+	return 0;
+}
+
+// Clear mailslot (called by "release" ioctl operation)
+static int clearMailslot(struct mailslot *ms)
+{
+	printk("Mailslot %d cleared\n", ms->minor);
+	return 0;
+}
+
+// debugfs: /sys/kernel/debug/mailslot/<minor> shows the summed counters
+static int mailslot_stats_show(struct seq_file *m, void *unused)
+{
+	struct mailslot *ms = m->private;
+	struct mailslot_stats sum = { 0 };
+	struct mailslot_mpmc *q;
+	int cpu;
+
+	for_each_possible_cpu(cpu)
+	{
+		struct mailslot_stats *st = per_cpu_ptr(ms->stats, cpu);
+
+		sum.pushed += st->pushed;
+		sum.popped += st->popped;
+		sum.dropped_full += st->dropped_full;
+		sum.dropped_slow += st->dropped_slow;
+		sum.expired += st->expired;
+		sum.bytes_in += st->bytes_in;
+		sum.bytes_out += st->bytes_out;
+		sum.contended += st->contended;
+		sum.high_water = max(sum.high_water, st->high_water);
+	}
+
+	seq_printf(m, "pushed: %llu\n", sum.pushed);
+	seq_printf(m, "popped: %llu\n", sum.popped);
+	seq_printf(m, "dropped_full: %llu\n", sum.dropped_full);
+	seq_printf(m, "dropped_slow: %llu\n", sum.dropped_slow);
+	seq_printf(m, "expired: %llu\n", sum.expired);
+	seq_printf(m, "bytes_in: %llu\n", sum.bytes_in);
+	seq_printf(m, "bytes_out: %llu\n", sum.bytes_out);
+	seq_printf(m, "high_water: %u\n", sum.high_water);
+	rcu_read_lock();
+	seq_printf(m, "used: %u\n", ringUsed(ms));
+	rcu_read_unlock();
+	seq_printf(m, "large_bytes: %ld\n", atomic_long_read(&ms->eng.large_bytes));
+	seq_printf(m, "urgent_bytes: %zu\n", READ_ONCE(ms->urgent_bytes));
+	seq_printf(m, "ttl_ms: %llu\n", div_u64(READ_ONCE(ms->eng.ttl), NSEC_PER_MSEC));
+	seq_printf(m, "ring_size: %u\n", READ_ONCE(ms->eng.size));
+	rcu_read_lock();
+	q = READ_ONCE(ms->mpmc);
+	if (q)
+		seq_printf(m, "mpmc_used: %u\n", mpmcUsed(q));
+	rcu_read_unlock();
+	seq_printf(m, "contended: %llu\n", sum.contended);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(mailslot_stats);
+
+static struct dentry *mailslot_debugfs;
+
+// File operations struct
+static struct file_operations fops =
+{
+	.read_iter = mailslot_read_iter,
+	.write_iter = mailslot_write_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+	.splice_read = copy_splice_read,
+#else
+	.splice_read = generic_file_splice_read,
+#endif
+	.splice_write = iter_file_splice_write,
+	.poll = mailslot_poll,
+	.mmap = mailslot_mmap,
+	.unlocked_ioctl = mailslot_ioctl,
+	.open =  mailslot_open,
+	.release = mailslot_release
+};
+
+// Allocate and initialize the instance for "minor", including its ring
+static struct mailslot *allocInstance(int minor)
+{
+	struct mailslot *ms = kmem_cache_zalloc(mailslot_cache, GFP_KERNEL);
+	char name[8];
+	int i;
+
+	if (!ms)
+		return NULL;
+
+	if (mailslot_engine_init(&ms->eng, ring_size, message_size, inline_size))
+	{
+		kmem_cache_free(mailslot_cache, ms);
+		return NULL;
+	}
+	ms->stats = alloc_percpu(struct mailslot_stats);
+	if (!ms->stats || percpu_init_rwsem(&ms->fast_sem))
+	{
+		mailslot_engine_destroy(&ms->eng);
+		free_percpu(ms->stats);
+		kmem_cache_free(mailslot_cache, ms);
+		return NULL;
+	}
+
+	ms->minor = minor;
+	refcount_set(&ms->refs, 1);
+	ms->mode = MAILSLOT_MODE_LOCKED;
+	mutex_init(&ms->mutex);
+	init_waitqueue_head(&ms->readq);
+	init_waitqueue_head(&ms->writeq);
+	INIT_LIST_HEAD(&ms->subscribers);
+	for (i = 0; i < MAILSLOT_PRIORITIES - 1; i++)
+		INIT_LIST_HEAD(&ms->urgent[i]);
+	INIT_DELAYED_WORK(&ms->stage_work, stageWork);
+
+	// Statistics (debugfs failures are not fatal)
+	snprintf(name, sizeof(name), "%d", minor);
+	ms->debugfs = debugfs_create_file(name, 0444, mailslot_debugfs, ms, &mailslot_stats_fops);
+
+	return ms;
+}
+
+static void freeInstanceRcu(struct rcu_head *rcu)
+{
+	kmem_cache_free(mailslot_cache, container_of(rcu, struct mailslot, rcu));
+}
+
+// Tear down an instance already unpublished from instances[]. Lockless
+// lookups may still see the header until a grace period has elapsed, but
+// they fail to take a reference and touch nothing else.
+static void destroyInstance(struct mailslot *ms)
+{
+	debugfs_remove(ms->debugfs);	// Waits for statistics readers
+	cancel_delayed_work_sync(&ms->stage_work);	// No writer is left to queue it again
+	free_percpu(ms->stage);
+	vfree(ms->mpmc);
+	while (ms->urgent_mask)
+		urgentDrop(ms);
+	mailslot_engine_destroy(&ms->eng);
+	free_percpu(ms->stats);
+	percpu_free_rwsem(&ms->fast_sem);
+	call_rcu(&ms->rcu, freeInstanceRcu);
+}
+
+// Get a referenced instance for "minor", allocating it on first use
+static struct mailslot *getInstance(int minor)
+{
+	struct mailslot *ms;
+
+	// 1. Fast path: instance already published and in use
+	rcu_read_lock();
+	ms = rcu_dereference(instances[minor]);
+	if (ms && !refcount_inc_not_zero(&ms->refs))
+		ms = NULL;
+	rcu_read_unlock();
+	if (ms)
+		return ms;
+
+	// 2. Slow path: revive an idle instance that still holds messages, or create one
+	mutex_lock(&instances_lock);
+	ms = rcu_dereference_protected(instances[minor], lockdep_is_held(&instances_lock));
+	if (ms)
+	{
+		// Instances are only freed under instances_lock, a zero count is safe to raise
+		if (!refcount_inc_not_zero(&ms->refs))
+			refcount_set(&ms->refs, 1);
+	}
+	else
+	{
+		ms = allocInstance(minor);
+		if (ms)
+			rcu_assign_pointer(instances[minor], ms);
+	}
+	mutex_unlock(&instances_lock);
+
+	return ms ? ms : ERR_PTR(-ENOMEM);
+}
+
+// Drop a reference. The last one frees the instance unless messages are queued.
+static void putInstance(struct mailslot *ms)
+{
+	if (!refcount_dec_and_mutex_lock(&ms->refs, &instances_lock))
+		return;
+
+	if (ringUsed(ms) > 0 || ms->urgent_mask || stageBusy(ms) || (ms->mpmc && mpmcUsed(ms->mpmc)))
+	{
+		mutex_unlock(&instances_lock);
+		return;
+	}
+
+	RCU_INIT_POINTER(instances[ms->minor], NULL);
+	mutex_unlock(&instances_lock);
+
+	destroyInstance(ms);
+}
+
+// Free remaining instances (idle ones holding messages), then the slab cache
+static void freeInstances(void)
+{
+	int i;
+	for (i = 0; instances && i < nr_instances; i++)
+	{
+		struct mailslot *ms = rcu_dereference_protected(instances[i], 1);
+
+		if (!ms)
+			continue;
+		RCU_INIT_POINTER(instances[i], NULL);
+		destroyInstance(ms);
+	}
+
+	if (mailslot_cache)
+	{
+		rcu_barrier();	// Pending freeInstanceRcu() callbacks
+		kmem_cache_destroy(mailslot_cache);
+	}
+	kvfree(instances);
+}
+
+static int __init mailslot_init(void)
+{
+	// Validate module parameters
+	if (nr_instances == 0 || nr_instances > MAX_INSTANCES || !validGeometry(ring_size, message_size, inline_size))
+	{
+		printk("Invalid mailslot parameters: instances=%u message_size=%u ring_size=%u inline_size=%u\n", nr_instances, message_size, ring_size, inline_size);
+		return -EINVAL;
+	}
+
+	// Up to MINORMASK + 1 pointers, more than kmalloc() serves
+	instances = kvcalloc(nr_instances, sizeof(*instances), GFP_KERNEL);
+	if (!instances)
+		return -ENOMEM;
+
+	// Create slab cache (visible in /proc/slabinfo)
+	mailslot_cache = kmem_cache_create("mailslot", sizeof(struct mailslot), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!mailslot_cache)
+	{
+		printk("Creating mailslot slab cache failed\n");
+		freeInstances();
+		return -ENOMEM;
+	}
+
+	// Instances are allocated on first open, only the statistics directory is set up now
+	// (debugfs failures are not fatal)
+	mailslot_debugfs = debugfs_create_dir(DEVICE_NAME, NULL);
+
+	/* cdev setup */
+	// 1. Allocate dynamically a device numbers region
+	dev_t dev;
+	int err = alloc_chrdev_region(&dev, MINOR_LOWER, MINOR_LOWER+nr_instances, DEVICE_NAME);
+
+	if (err)
+	{
+		printk("Allocating chrdev region failed\n");
+		freeInstances();
+		debugfs_remove_recursive(mailslot_debugfs);
+		return err;
+	}
+
+	Major = MAJOR(dev);
+
+	// 2. Allocate cdev struct
+	mailslot_cdev = cdev_alloc();
+
+	// 3. Init cdev
+	cdev_init(mailslot_cdev, &fops);
+
+	// 4. Add cdev
+	err = cdev_add(mailslot_cdev, dev, MINOR_LOWER+nr_instances);
+
+	if (err)
+	{
+		printk("Adding cdev failed\n");
+		unregister_chrdev_region(dev, nr_instances);
+		freeInstances();
+		debugfs_remove_recursive(mailslot_debugfs);
+		return err;
+	}
+
+	// Old way:
+	// Major = register_chrdev(MINOR_LOWER, DEVICE_NAME, &fops);
+
+	if (Major < 0) 
+	{
+		printk("Registering mailslot device failed\n");
+		return Major;
+	}
+
+	printk(KERN_INFO "Mailslot device registered, it is assigned major number %d\n", Major);
+
+	return 0;
+}
+
+static void __exit mailslot_exit(void)
+{
+	printk("Cleaning Mailslot Module Up\n");
+
+	cdev_del(mailslot_cdev);
+	unregister_chrdev_region(MKDEV(Major, MINOR_LOWER), nr_instances);
+
+	// De-Allocate memory for mailslots still holding messages
+	// (queued messages live inside the ring, nothing to walk)
+	freeInstances();
+	debugfs_remove_recursive(mailslot_debugfs);
+
+	printk(KERN_INFO "Mailslot device unregistered, it was assigned major number %d\n", Major);
+}
+
+// Initcalls, so the driver also registers when built into the kernel (UML KUnit runs)
+module_init(mailslot_init);
+module_exit(mailslot_exit);
+
+// KUnit suite, it needs the static functions above
+#if IS_ENABLED(CONFIG_MAILSLOT_KUNIT_TEST)
+#include "mailslot_test.c"
+#endif
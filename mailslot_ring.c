@@ -0,0 +1,385 @@
+/* Record engine of the mailslot byte ring and its locked push/pop, see
+ * mailslot_ring.h */
+
+#ifdef __KERNEL__
+#include <linux/kernel.h>
+#include <linux/mm.h>		/* For PAGE_ALIGN */
+#include <linux/vmalloc.h>	/* For vmalloc_user (mappable ring) */
+#include <linux/atomic.h>
+#include <linux/uio.h>		/* For iov_iter */
+#include <linux/xarray.h>	/* Out-of-line payloads */
+#include <linux/overflow.h>	/* For struct_size */
+#include <linux/timekeeping.h>	/* Message expiry */
+#else
+#include "lib/kcompat.h"	/* Userspace build */
+#endif
+
+#include "mailslot_ring.h"
+
+struct mailslot_ring_hdr *mailslot_ring_alloc(unsigned int size, unsigned int max_msg, unsigned int inline_max)
+{
+	size_t data_offset = PAGE_ALIGN(sizeof(struct mailslot_ring_hdr));
+	struct mailslot_ring_hdr *hdr = vmalloc_user(data_offset + size);
+
+	if (!hdr)
+		return NULL;
+
+	hdr->size = size;
+	hdr->max_msg = max_msg;
+	hdr->inline_max = min(inline_max, max_msg);
+	hdr->data_offset = data_offset;
+	return hdr;
+}
+
+void mailslot_ring_free(struct mailslot_ring_hdr *hdr)
+{
+	vfree(hdr);
+}
+
+unsigned int mailslot_ring_used(struct mailslot_ring_hdr *hdr, unsigned int size)
+{
+	unsigned int head = smp_load_acquire(&hdr->head);
+	unsigned int tail = smp_load_acquire(&hdr->tail);
+
+	return min_t(unsigned int, tail - head, size);
+}
+
+unsigned int mailslot_record_need(unsigned int size, unsigned int tail, size_t len)
+{
+	unsigned int off = tail & (size - 1);
+	unsigned int need = MAILSLOT_RECORD_SIZE(len);
+
+	return off + need > size ? size - off + need : need;
+}
+
+struct mailslot_record *mailslot_record_reserve(char *ring, unsigned int size, unsigned int *tail, size_t len)
+{
+	unsigned int off = *tail & (size - 1);
+	struct mailslot_record *rec;
+
+	if (off + MAILSLOT_RECORD_SIZE(len) > size)
+	{
+		rec = (struct mailslot_record *)(ring + off);
+		rec->len = size - off - sizeof(*rec);
+		rec->flags = MAILSLOT_RECORD_PAD;
+		*tail += size - off;
+		off = 0;
+	}
+
+	rec = (struct mailslot_record *)(ring + off);
+	rec->len = len;
+	rec->flags = 0;
+	*tail += MAILSLOT_RECORD_SIZE(len);
+	return rec;
+}
+
+char *mailslot_record_find(char *ring, unsigned int size, unsigned int head, unsigned int tail, struct mailslot_record *rec, unsigned int *next)
+{
+	unsigned int off = head & (size - 1);
+	struct mailslot_record *r;
+
+	if (off & (MAILSLOT_RECORD_ALIGN - 1))
+		return NULL;
+
+	r = (struct mailslot_record *)(ring + off);
+	if (READ_ONCE(r->flags) & MAILSLOT_RECORD_PAD)
+	{
+		head += size - off;
+		off = 0;
+		r = (struct mailslot_record *)ring;
+	}
+
+	rec->len = READ_ONCE(r->len);
+	rec->flags = READ_ONCE(r->flags);
+	if (off + MAILSLOT_RECORD_SIZE(rec->len) > size ||
+	    tail - head < MAILSLOT_RECORD_SIZE(rec->len) || tail - head > size)
+		return NULL;
+
+	*next = head + MAILSLOT_RECORD_SIZE(rec->len);
+	return (char *)(r + 1);
+}
+
+int mailslot_engine_init(struct mailslot_engine *e, unsigned int size, unsigned int max_msg, unsigned int inline_max)
+{
+	struct mailslot_ring_hdr *hdr = mailslot_ring_alloc(size, max_msg, inline_max);
+
+	if (!hdr)
+		return -ENOMEM;
+
+	mailslot_engine_set_ring(e, hdr);
+	e->ttl = 0;
+	xa_init_flags(&e->large, XA_FLAGS_ALLOC);
+	atomic_long_set(&e->large_bytes, 0);
+	return 0;
+}
+
+void mailslot_engine_destroy(struct mailslot_engine *e)
+{
+	struct mailslot_large *large;
+	unsigned long id;
+
+	xa_for_each(&e->large, id, large)
+		vfree(large);
+	xa_destroy(&e->large);
+	mailslot_ring_free(e->shared);
+}
+
+void mailslot_engine_set_ring(struct mailslot_engine *e, struct mailslot_ring_hdr *hdr)
+{
+	e->shared = hdr;
+	e->ring = (char *)hdr + hdr->data_offset;
+	e->size = hdr->size;
+	e->max_msg = hdr->max_msg;
+	e->inline_max = hdr->inline_max;
+}
+
+size_t mailslot_engine_inline_len(struct mailslot_engine *e, size_t len)
+{
+	size_t ttl = e->ttl ? sizeof(__u64) : 0;
+
+	return ttl + (len > e->inline_max ? sizeof(struct mailslot_external) : len);
+}
+
+bool mailslot_engine_large_fits(struct mailslot_engine *e, size_t need)
+{
+	return atomic_long_read(&e->large_bytes) + need <= MAILSLOT_MAX_LARGE_BYTES;
+}
+
+bool mailslot_expired(u64 expires)
+{
+	return expires && expires <= ktime_get_ns();
+}
+
+int mailslot_engine_peek(struct mailslot_engine *e, unsigned int head, unsigned int tail, struct mailslot_view *v)
+{
+	struct mailslot_record rec;
+	__u32 len, flags;
+	char *payload;
+
+	payload = mailslot_record_find(e->ring, e->size, head, tail, &rec, &v->next);
+	if (!payload)
+		return -EIO;
+	len = rec.len;
+	flags = rec.flags;
+
+	// Expiry comes first in the record
+	v->expires = 0;
+	if (flags & MAILSLOT_RECORD_EXPIRES)
+	{
+		if (len < sizeof(__u64))
+			return -EIO;
+		v->expires = READ_ONCE(*(__u64 *)payload);
+		payload += sizeof(__u64);
+		len -= sizeof(__u64);
+	}
+
+	v->external = flags & MAILSLOT_RECORD_EXTERNAL;
+	if (v->external)
+	{
+		struct mailslot_external *ext = (struct mailslot_external *)payload;
+		struct mailslot_large *large;
+
+		if (len != sizeof(*ext))
+			return -EIO;
+		v->id = READ_ONCE(ext->id);
+		large = xa_load(&e->large, v->id);
+		if (!large)
+			return -EIO;
+		v->data = large->data;
+		v->len = large->len;
+	}
+	else
+	{
+		if (len > e->max_msg)
+			return -EIO;
+		v->data = payload;
+		v->len = len;
+	}
+	return 0;
+}
+
+// Copy a message above the inline threshold into its own page-backed
+// buffer, keeping large payloads out of the kmalloc caches, and describe
+// it in "ext" for the ring record
+static int largeStore(struct mailslot_engine *e, struct mailslot_external *ext, struct iov_iter *from, size_t len)
+{
+	struct mailslot_large *large = vmalloc(struct_size(large, data, len));
+	u32 id;
+
+	if (!large)
+		return -ENOMEM;
+
+	if (copy_from_iter(large->data, len, from) != len)
+	{
+		vfree(large);
+		return -EFAULT;
+	}
+	large->len = len;
+
+	if (xa_alloc(&e->large, &id, large, xa_limit_32b, GFP_KERNEL))
+	{
+		vfree(large);
+		return -ENOMEM;
+	}
+	atomic_long_add(len, &e->large_bytes);
+
+	ext->id = id;
+	ext->len = len;
+	return 0;
+}
+
+void mailslot_engine_large_free(struct mailslot_engine *e, u32 id)
+{
+	struct mailslot_large *large = xa_erase(&e->large, id);
+
+	if (!large)
+		return;
+	atomic_long_sub(large->len, &e->large_bytes);
+	vfree(large);
+}
+
+void mailslot_engine_discard(struct mailslot_engine *e, unsigned int from, unsigned int to)
+{
+	struct mailslot_view v;
+
+	while (from != to && !mailslot_engine_peek(e, from, to, &v))
+	{
+		if (v.external)
+			mailslot_engine_large_free(e, v.id);
+		from = v.next;
+	}
+}
+
+int mailslot_engine_fill(struct mailslot_engine *e, struct mailslot_record *rec, struct iov_iter *from, size_t len)
+{
+	char *payload = (char *)(rec + 1);
+
+	if (e->ttl)
+	{
+		rec->flags |= MAILSLOT_RECORD_EXPIRES;
+		*(__u64 *)payload = ktime_get_ns() + e->ttl;
+		payload += sizeof(__u64);
+	}
+
+	if (len > e->inline_max)
+	{
+		rec->flags |= MAILSLOT_RECORD_EXTERNAL;
+		return largeStore(e, (struct mailslot_external *)payload, from, len);
+	}
+
+	return copy_from_iter(payload, len, from) != len ? -EFAULT : 0;
+}
+
+int mailslot_engine_push(struct mailslot_engine *e, struct iov_iter *from, size_t len)
+{
+	struct mailslot_ring_hdr *hdr = e->shared;
+	unsigned int head = smp_load_acquire(&hdr->head);
+	unsigned int tail = READ_ONCE(hdr->tail);
+	struct mailslot_record *rec;
+	int err;
+
+	if (len > e->max_msg)
+		return -EINVAL;
+
+	// Records must start aligned, mmap producers may have moved tail anywhere
+	if (tail & (MAILSLOT_RECORD_ALIGN - 1))
+		return -EIO;
+
+	// 1. Check if there's space (possibly after wrapping)
+	if (tail - head + mailslot_record_need(e->size, tail, mailslot_engine_inline_len(e, len)) > e->size ||
+	    !mailslot_engine_large_fits(e, len > e->inline_max ? len : 0))
+		return -ENOSPC;
+
+	// 2. Copy input message into a new record
+	rec = mailslot_record_reserve(e->ring, e->size, &tail, mailslot_engine_inline_len(e, len));
+	err = mailslot_engine_fill(e, rec, from, len);
+	if (err)
+		return err;
+
+	// 3. Publish record to consumers
+	smp_store_release(&hdr->tail, tail);
+	return 0;
+}
+
+int mailslot_engine_push_batch(struct mailslot_engine *e, struct iov_iter *from, const struct iovec *iov, unsigned int count)
+{
+	struct mailslot_ring_hdr *hdr = e->shared;
+	unsigned int head = smp_load_acquire(&hdr->head);
+	unsigned int first = READ_ONCE(hdr->tail);
+	unsigned int tail = first;
+	unsigned int need = 0, i;
+	size_t large = 0;
+
+	for (i = 0; i < count; i++)
+	{
+		if (iov[i].iov_len > e->max_msg)
+			return -EINVAL;
+		need += mailslot_record_need(e->size, tail + need, mailslot_engine_inline_len(e, iov[i].iov_len));
+		if (iov[i].iov_len > e->inline_max)
+			large += iov[i].iov_len;
+	}
+	if (tail & (MAILSLOT_RECORD_ALIGN - 1))
+		return -EIO;
+
+	if (tail - head + need > e->size || !mailslot_engine_large_fits(e, large))
+		return -ENOSPC;
+
+	// Each record consumes its iovec of the iterator
+	for (i = 0; i < count; i++)
+	{
+		unsigned int start = tail;
+		struct mailslot_record *rec = mailslot_record_reserve(e->ring, e->size, &tail, mailslot_engine_inline_len(e, iov[i].iov_len));
+		int err = mailslot_engine_fill(e, rec, from, iov[i].iov_len);
+
+		if (err)
+		{
+			// Drop the payloads already stored for this batch
+			mailslot_engine_discard(e, first, start);
+			return err;
+		}
+	}
+
+	smp_store_release(&hdr->tail, tail);
+	return 0;
+}
+
+int mailslot_engine_pop(struct mailslot_engine *e, unsigned int *head, unsigned int tail, struct iov_iter *to, size_t *len, unsigned int *expired, unsigned int flags)
+{
+	size_t extra = flags & MAILSLOT_POP_NEWLINE ? 1 : 0;
+	bool free_large = !(flags & MAILSLOT_POP_SHARED);
+	struct mailslot_view v;
+	int err;
+
+	// 1. Find the message at head, lazily dropping expired ones
+	for (;;)
+	{
+		err = *head == tail ? -EAGAIN : mailslot_engine_peek(e, *head, tail, &v);
+		if (err)
+			return err;
+		if (!mailslot_expired(v.expires))
+			break;
+
+		if (v.external && free_large)
+			mailslot_engine_large_free(e, v.id);
+		*head = v.next;
+		(*expired)++;
+	}
+
+	if (iov_iter_count(to) < v.len + extra)
+	{
+		*len = v.len;
+		return -EINVAL;
+	}
+
+	// 2. Copy message out of the ring (or its own buffer)
+	if (copy_to_iter(v.data, v.len, to) != v.len ||
+	    (extra && copy_to_iter("\n", 1, to) != 1))
+		return -EFAULT;
+
+	// 3. Consume it, the caller hands the bytes back to producers
+	if (v.external && free_large)
+		mailslot_engine_large_free(e, v.id);
+	*head = v.next;
+	*len = v.len;
+	return 0;
+}
@@ -0,0 +1,117 @@
+/* Record engine of the mailslot byte ring (layout in mailslot.h) and the
+ * locked push/pop built on it. Built into the module and, over
+ * lib/kcompat.h, into the userspace queue library used by the benchmarks.
+ * Callers serialize producers and consumers; the driver keeps its
+ * policies (priorities, broadcast cursors, overflow, statistics) around
+ * these calls. */
+
+#ifndef _MAILSLOT_RING_H
+#define _MAILSLOT_RING_H
+
+#include "mailslot.h"
+
+// Allocate a mappable ring: a header page with the offsets, then "size"
+// bytes of records
+struct mailslot_ring_hdr *mailslot_ring_alloc(unsigned int size, unsigned int max_msg, unsigned int inline_max);
+void mailslot_ring_free(struct mailslot_ring_hdr *hdr);
+
+// Number of queued bytes. Offsets may be moved by mmap users at any time,
+// so they are never trusted to be more than "size" apart.
+unsigned int mailslot_ring_used(struct mailslot_ring_hdr *hdr, unsigned int size);
+
+// Bytes taken by a record of "len" payload bytes appended at "tail",
+// including the padding record needed when it would straddle the end of
+// the ring
+unsigned int mailslot_record_need(unsigned int size, unsigned int tail, size_t len);
+
+// Start a record of "len" payload bytes at "*tail", writing a padding
+// record first if it would wrap, and advance "*tail" past it. Nothing is
+// visible to consumers until tail is published.
+struct mailslot_record *mailslot_record_reserve(char *ring, unsigned int size, unsigned int *tail, size_t len);
+
+// Locate the record at "head", stepping over a padding record. Its header
+// is read once into "*rec" (mapped rings can change under us) and the
+// offset of the following record stored in "*next". Returns its payload,
+// or NULL if the record is misaligned, runs past the ring or past "tail".
+char *mailslot_record_find(char *ring, unsigned int size, unsigned int head, unsigned int tail, struct mailslot_record *rec, unsigned int *next);
+
+#define MAILSLOT_MAX_LARGE_BYTES (256 << 20)	// Out-of-line bytes queued per ring
+
+// Payload of a message above the inline threshold. Only its id travels
+// through the ring, the buffer itself never leaves the kernel.
+struct mailslot_large
+{
+	size_t len;
+	char data[];
+};
+
+// A ring and the out-of-line payloads its records point to
+struct mailslot_engine
+{
+	// Replaced only under the caller's topology lock; lockless readers use RCU
+	struct mailslot_ring_hdr *shared;	// FIFO offsets, mappable by user space
+	char *ring;		// "size" bytes of records, right after the header
+	unsigned int size;	// Trusted copies of the shared geometry
+	unsigned int max_msg;
+	unsigned int inline_max;
+	u64 ttl;		// Time to live of new messages in ns, 0 = forever
+	struct xarray large;	// Out-of-line payloads (struct mailslot_large) by id
+	atomic_long_t large_bytes;	// Their total size
+};
+
+// A queued message as found by mailslot_engine_peek()
+struct mailslot_view
+{
+	const char *data;	// Payload, in the ring or out of line
+	size_t len;
+	unsigned int next;	// Offset of the following record
+	bool external;		// "id" names an out-of-line payload to free once consumed
+	u32 id;
+	u64 expires;		// ktime_get_ns() deadline, 0 = never
+};
+
+// mailslot_engine_pop() flags
+#define MAILSLOT_POP_NEWLINE 0x1	// Append a newline, as read() does
+#define MAILSLOT_POP_SHARED 0x2		// Other readers still need the payload (broadcast)
+
+// Allocate the ring of an engine, or release it with its payloads
+int mailslot_engine_init(struct mailslot_engine *e, unsigned int size, unsigned int max_msg, unsigned int inline_max);
+void mailslot_engine_destroy(struct mailslot_engine *e);
+
+// Switch to "hdr", taking its geometry. The old ring is the caller's.
+void mailslot_engine_set_ring(struct mailslot_engine *e, struct mailslot_ring_hdr *hdr);
+
+// Bytes a message of "len" occupies inside its record, with its expiry
+// when a time to live is set
+size_t mailslot_engine_inline_len(struct mailslot_engine *e, size_t len);
+bool mailslot_engine_large_fits(struct mailslot_engine *e, size_t need);
+bool mailslot_expired(u64 expires);
+
+// Decode the message at "head". Records live in memory user space can
+// write, so a malformed one (bad offset, oversized, past "tail" or naming
+// an unknown payload) yields -EIO.
+int mailslot_engine_peek(struct mailslot_engine *e, unsigned int head, unsigned int tail, struct mailslot_view *v);
+
+// Fill a reserved record with the next "len" bytes of "from", inline or
+// out of line
+int mailslot_engine_fill(struct mailslot_engine *e, struct mailslot_record *rec, struct iov_iter *from, size_t len);
+
+// Free an out-of-line payload, or those of the records in [from, to)
+void mailslot_engine_large_free(struct mailslot_engine *e, u32 id);
+void mailslot_engine_discard(struct mailslot_engine *e, unsigned int from, unsigned int to);
+
+// Append one message of "len" bytes, or one per iovec (lengths only, the
+// bytes come from "from") published with a single tail update. Returns 0,
+// -EINVAL if too long, -ENOSPC if full, -EIO if user space misaligned
+// tail, -EFAULT or -ENOMEM; nothing is published on error.
+int mailslot_engine_push(struct mailslot_engine *e, struct iov_iter *from, size_t len);
+int mailslot_engine_push_batch(struct mailslot_engine *e, struct iov_iter *from, const struct iovec *iov, unsigned int count);
+
+// Copy the message at "*head" into "to" and step "*head" past it; the
+// caller publishes it. Expired messages before it are skipped (even on
+// error) and counted in "*expired". Returns 0 with its length in "*len",
+// -EAGAIN if none is left, -EINVAL if "to" is too small (the message stays
+// queued), -EFAULT or -EIO.
+int mailslot_engine_pop(struct mailslot_engine *e, unsigned int *head, unsigned int tail, struct iov_iter *to, size_t *len, unsigned int *expired, unsigned int flags);
+
+#endif
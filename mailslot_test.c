@@ -0,0 +1,501 @@
+/* KUnit suite of the mailslot queue: the record engine of mailslot_ring.c
+ * on a small ring of its own, and pushMessage()/getMessage() on a driver
+ * instance. Data goes in and out through kvec iterators, as write() and
+ * read() hand it over once the user buffers are imported.
+ *
+ * Included at the end of mailslot_main.c when CONFIG_MAILSLOT_KUNIT_TEST
+ * is set, to reach its static functions. See the Makefile for UML. */
+
+#include <kunit/test.h>
+#include <linux/kthread.h>
+#include <linux/completion.h>
+
+// Engine geometry: eight 24-byte messages fill the ring exactly, longer
+// ones are kept out of line
+#define TEST_RING_SIZE 256
+#define TEST_MAX_MSG 64
+#define TEST_INLINE_MAX 24
+
+#define TEST_PRODUCERS 4
+#define TEST_CONSUMERS 2
+#define TEST_MESSAGES 20000	// Per producer
+#define TEST_BENCH_ROUNDS 100000
+
+// Byte "i" of message "seq", so any message can be checked on its own
+static u8 testByte(unsigned int seq, size_t i)
+{
+	return (u8)(seq * 31 + i);
+}
+
+static void testFill(char *buf, unsigned int seq, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		buf[i] = testByte(seq, i);
+}
+
+static bool testCheck(const char *buf, unsigned int seq, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if ((u8)buf[i] != testByte(seq, i))
+			return false;
+	return true;
+}
+
+// Varying lengths, some of them out of line
+static size_t testLen(unsigned int seq)
+{
+	return 1 + (seq * 7) % TEST_MAX_MSG;
+}
+
+/* Record engine */
+
+static int enginePush(struct mailslot_engine *e, const char *buf, size_t len)
+{
+	struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+	struct iov_iter from;
+
+	iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, len);
+	return mailslot_engine_push(e, &from, len);
+}
+
+// Pop into "buf" and hand the bytes back to producers, as a locked reader does
+static int enginePop(struct mailslot_engine *e, char *buf, size_t size, size_t *len)
+{
+	struct kvec kv = { .iov_base = buf, .iov_len = size };
+	unsigned int head = READ_ONCE(e->shared->head);
+	unsigned int expired = 0;
+	struct iov_iter to;
+	int err;
+
+	iov_iter_kvec(&to, ITER_DEST, &kv, 1, size);
+	err = mailslot_engine_pop(e, &head, smp_load_acquire(&e->shared->tail), &to, len, &expired, 0);
+	if (!err || expired)
+		smp_store_release(&e->shared->head, head);
+	return err;
+}
+
+static int mailslot_engine_test_init(struct kunit *test)
+{
+	struct mailslot_engine *e = kunit_kzalloc(test, sizeof(*e), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_NULL(test, e);
+	KUNIT_ASSERT_EQ(test, mailslot_engine_init(e, TEST_RING_SIZE, TEST_MAX_MSG, TEST_INLINE_MAX), 0);
+	test->priv = e;
+	return 0;
+}
+
+// Whatever is still queued, out-of-line payloads included, goes with the engine
+static void mailslot_engine_test_exit(struct kunit *test)
+{
+	mailslot_engine_destroy(test->priv);
+}
+
+// Messages come out in order and intact while the ring wraps, with padding
+// records and out-of-line payloads along the way
+static void mailslot_engine_test_fifo(struct kunit *test)
+{
+	struct mailslot_engine *e = test->priv;
+	char in[TEST_MAX_MSG], out[TEST_MAX_MSG];
+	unsigned int pushed = 0, popped = 0;
+	size_t len;
+	int err;
+
+	while (popped < 1000)
+	{
+		testFill(in, pushed, testLen(pushed));
+		err = pushed < 1000 ? enginePush(e, in, testLen(pushed)) : -ENOSPC;
+		if (!err)
+		{
+			pushed++;
+			continue;
+		}
+		KUNIT_ASSERT_EQ(test, err, -ENOSPC);
+
+		// Full (or done pushing): take the oldest one back
+		KUNIT_ASSERT_EQ(test, enginePop(e, out, sizeof(out), &len), 0);
+		KUNIT_ASSERT_EQ(test, len, testLen(popped));
+		KUNIT_ASSERT_TRUE(test, testCheck(out, popped, len));
+		popped++;
+	}
+
+	KUNIT_EXPECT_EQ(test, enginePop(e, out, sizeof(out), &len), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, mailslot_ring_used(e->shared, e->size), 0U);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&e->large_bytes), 0L);
+}
+
+// The ring is full exactly when its bytes are taken, and empty once they
+// are handed back
+static void mailslot_engine_test_full_empty(struct kunit *test)
+{
+	struct mailslot_engine *e = test->priv;
+	unsigned int slots = TEST_RING_SIZE / MAILSLOT_RECORD_SIZE(TEST_INLINE_MAX);
+	char buf[TEST_MAX_MSG + 1];
+	unsigned int i;
+	size_t len;
+
+	KUNIT_EXPECT_EQ(test, enginePop(e, buf, sizeof(buf), &len), -EAGAIN);
+
+	for (i = 0; i < slots; i++)
+	{
+		testFill(buf, i, TEST_INLINE_MAX);
+		KUNIT_ASSERT_EQ(test, enginePush(e, buf, TEST_INLINE_MAX), 0);
+	}
+	KUNIT_EXPECT_EQ(test, mailslot_ring_used(e->shared, e->size), (unsigned int)TEST_RING_SIZE);
+	KUNIT_EXPECT_EQ(test, enginePush(e, buf, 1), -ENOSPC);
+
+	// Too long is refused before space is even looked at
+	KUNIT_EXPECT_EQ(test, enginePush(e, buf, TEST_MAX_MSG + 1), -EINVAL);
+
+	// A short buffer leaves the message queued and reports its length
+	KUNIT_EXPECT_EQ(test, enginePop(e, buf, TEST_INLINE_MAX - 1, &len), -EINVAL);
+	KUNIT_EXPECT_EQ(test, len, (size_t)TEST_INLINE_MAX);
+
+	// One record out, one record in
+	KUNIT_ASSERT_EQ(test, enginePop(e, buf, sizeof(buf), &len), 0);
+	KUNIT_EXPECT_TRUE(test, testCheck(buf, 0, len));
+	KUNIT_EXPECT_EQ(test, enginePush(e, buf, TEST_INLINE_MAX), 0);
+	KUNIT_EXPECT_EQ(test, enginePush(e, buf, 1), -ENOSPC);
+
+	for (i = 0; i < slots; i++)
+		KUNIT_ASSERT_EQ(test, enginePop(e, buf, sizeof(buf), &len), 0);
+	KUNIT_EXPECT_EQ(test, enginePop(e, buf, sizeof(buf), &len), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, mailslot_ring_used(e->shared, e->size), 0U);
+}
+
+// Destroying an engine with messages queued releases their payloads
+// (KASAN and kmemleak catch the rest)
+static void mailslot_engine_test_teardown(struct kunit *test)
+{
+	struct mailslot_engine *e = test->priv;
+	char buf[TEST_MAX_MSG];
+	unsigned int seq = 0;
+	long large = 0;
+
+	for (;;)
+	{
+		size_t len = seq % 2 ? TEST_MAX_MSG : 8;
+
+		testFill(buf, seq, len);
+		if (enginePush(e, buf, len))
+			break;
+		if (len > TEST_INLINE_MAX)
+			large += len;
+		seq++;
+	}
+
+	KUNIT_EXPECT_GT(test, seq, 1U);
+	KUNIT_EXPECT_EQ(test, atomic_long_read(&e->large_bytes), large);
+	KUNIT_EXPECT_FALSE(test, xa_empty(&e->large));
+}
+
+// Hot path cost: one push and one pop per round, nothing else queued
+static void mailslot_engine_test_bench(struct kunit *test)
+{
+	struct mailslot_engine *e = test->priv;
+	char buf[TEST_MAX_MSG];
+	unsigned int i;
+	u64 push = 0, pop = 0, start;
+	size_t len;
+
+	testFill(buf, 0, 16);
+	for (i = 0; i < TEST_BENCH_ROUNDS; i++)
+	{
+		start = ktime_get_ns();
+		KUNIT_ASSERT_EQ(test, enginePush(e, buf, 16), 0);
+		push += ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		KUNIT_ASSERT_EQ(test, enginePop(e, buf, sizeof(buf), &len), 0);
+		pop += ktime_get_ns() - start;
+	}
+
+	kunit_info(test, "16 bytes: push %llu ns, pop %llu ns\n",
+		   div_u64(push, TEST_BENCH_ROUNDS), div_u64(pop, TEST_BENCH_ROUNDS));
+}
+
+static struct kunit_case mailslot_engine_test_cases[] = {
+	KUNIT_CASE(mailslot_engine_test_fifo),
+	KUNIT_CASE(mailslot_engine_test_full_empty),
+	KUNIT_CASE(mailslot_engine_test_teardown),
+	KUNIT_CASE(mailslot_engine_test_bench),
+	{}
+};
+
+static struct kunit_suite mailslot_engine_test_suite = {
+	.name = "mailslot_engine",
+	.init = mailslot_engine_test_init,
+	.exit = mailslot_engine_test_exit,
+	.test_cases = mailslot_engine_test_cases,
+};
+
+/* Driver instance */
+
+static int instPush(struct mailslot *ms, const char *buf, size_t len)
+{
+	struct kvec kv = { .iov_base = (void *)buf, .iov_len = len };
+	struct iov_iter from;
+	int err;
+
+	iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, len);
+	mutex_lock(&ms->mutex);
+	err = pushMessage(ms, &from, len);
+	mutex_unlock(&ms->mutex);
+	return err;
+}
+
+// "buf" takes the newline read() appends
+static int instPop(struct mailslot *ms, char *buf, size_t size, size_t *len)
+{
+	struct mailslot_file mf = { .ms = ms };
+	struct kvec kv = { .iov_base = buf, .iov_len = size };
+	struct iov_iter to;
+	int err;
+
+	iov_iter_kvec(&to, ITER_DEST, &kv, 1, size);
+	mutex_lock(&ms->mutex);
+	err = getMessage(ms, &mf, &to, len);
+	mutex_unlock(&ms->mutex);
+	return err;
+}
+
+// A minor past the last one: never published in instances[], so the
+// device and the suite cannot meet
+static int mailslot_inst_test_init(struct kunit *test)
+{
+	struct mailslot *ms = allocInstance(nr_instances);
+
+	KUNIT_ASSERT_NOT_NULL(test, ms);
+	test->priv = ms;
+	return 0;
+}
+
+static void mailslot_inst_test_exit(struct kunit *test)
+{
+	destroyInstance(test->priv);
+}
+
+// Ordering and both boundaries through the functions read() and write() use
+static void mailslot_inst_test_fifo(struct kunit *test)
+{
+	struct mailslot *ms = test->priv;
+	unsigned int slots = ms->eng.size / MAILSLOT_RECORD_SIZE(8);
+	char buf[8 + 1];
+	unsigned int i;
+	size_t len;
+
+	KUNIT_EXPECT_EQ(test, instPop(ms, buf, sizeof(buf), &len), -EAGAIN);
+
+	for (i = 0; i < slots; i++)
+	{
+		testFill(buf, i, 8);
+		KUNIT_ASSERT_EQ(test, instPush(ms, buf, 8), 0);
+	}
+	KUNIT_EXPECT_EQ(test, instPush(ms, buf, 8), -ENOSPC);
+	KUNIT_EXPECT_EQ(test, instPush(ms, buf, ms->eng.max_msg + 1), -EINVAL);
+
+	// The newline needs room too
+	KUNIT_EXPECT_EQ(test, instPop(ms, buf, 8, &len), -EINVAL);
+
+	for (i = 0; i < slots; i++)
+	{
+		KUNIT_ASSERT_EQ(test, instPop(ms, buf, sizeof(buf), &len), 0);
+		KUNIT_ASSERT_EQ(test, len, (size_t)8);
+		KUNIT_ASSERT_TRUE(test, testCheck(buf, i, 8));
+		KUNIT_ASSERT_EQ(test, buf[8], '\n');
+	}
+	KUNIT_EXPECT_EQ(test, instPop(ms, buf, sizeof(buf), &len), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, ringUsed(ms), 0U);
+}
+
+// Shared state of the concurrent test. Threads only count failures, the
+// test checks them once everyone is done.
+struct test_run
+{
+	struct mailslot *ms;
+	bool failed;		// Everyone stops
+	atomic_t consumed;
+	atomic_t errors;
+	atomic64_t sum;		// Of the consumed sequence numbers
+	struct test_worker
+	{
+		struct test_run *run;
+		unsigned int id;
+		struct completion done;
+	} workers[TEST_PRODUCERS + TEST_CONSUMERS];
+};
+
+static void testFail(struct test_run *run)
+{
+	atomic_inc(&run->errors);
+	WRITE_ONCE(run->failed, true);
+}
+
+// Messages are {producer, seq}
+static int testProduce(void *arg)
+{
+	struct test_worker *w = arg;
+	struct test_run *run = w->run;
+	u32 msg[2] = { w->id, 0 };
+	int err;
+
+	while (msg[1] < TEST_MESSAGES && !READ_ONCE(run->failed))
+	{
+		err = instPush(run->ms, (char *)msg, sizeof(msg));
+		if (!err)
+			msg[1]++;
+		else if (err == -ENOSPC)
+			cond_resched();
+		else
+			testFail(run);
+	}
+	kthread_complete_and_exit(&w->done, 0);
+}
+
+// Each consumer must see every producer's messages in the order they were sent
+static int testConsume(void *arg)
+{
+	struct test_worker *w = arg;
+	struct test_run *run = w->run;
+	char buf[2 * sizeof(u32) + 1];
+	s64 last[TEST_PRODUCERS];
+	u32 msg[2];
+	size_t len;
+	int i, err;
+
+	for (i = 0; i < TEST_PRODUCERS; i++)
+		last[i] = -1;
+
+	while (atomic_read(&run->consumed) < TEST_PRODUCERS * TEST_MESSAGES && !READ_ONCE(run->failed))
+	{
+		err = instPop(run->ms, buf, sizeof(buf), &len);
+		if (err == -EAGAIN)
+		{
+			cond_resched();
+			continue;
+		}
+
+		memcpy(msg, buf, sizeof(msg));
+		if (err || len != sizeof(msg) || msg[0] >= TEST_PRODUCERS || msg[1] <= last[msg[0]])
+		{
+			testFail(run);
+			break;
+		}
+		last[msg[0]] = msg[1];
+		atomic64_add(msg[1], &run->sum);
+		atomic_inc(&run->consumed);
+	}
+	kthread_complete_and_exit(&w->done, 0);
+}
+
+static void mailslot_inst_test_concurrent(struct kunit *test)
+{
+	struct test_run *run = kunit_kzalloc(test, sizeof(*run), GFP_KERNEL);
+	s64 sum = (s64)TEST_PRODUCERS * TEST_MESSAGES * (TEST_MESSAGES - 1) / 2;
+	struct task_struct *task;
+	unsigned int started;
+
+	KUNIT_ASSERT_NOT_NULL(test, run);
+	run->ms = test->priv;
+
+	for (started = 0; started < TEST_PRODUCERS + TEST_CONSUMERS; started++)
+	{
+		struct test_worker *w = &run->workers[started];
+
+		w->run = run;
+		init_completion(&w->done);
+		if (started < TEST_PRODUCERS)
+		{
+			w->id = started;
+			task = kthread_run(testProduce, w, "mailslot_prod/%u", w->id);
+		}
+		else
+		{
+			w->id = started - TEST_PRODUCERS;
+			task = kthread_run(testConsume, w, "mailslot_cons/%u", w->id);
+		}
+		if (IS_ERR(task))
+		{
+			testFail(run);
+			break;
+		}
+	}
+
+	while (started--)
+		wait_for_completion(&run->workers[started].done);
+
+	KUNIT_EXPECT_EQ(test, atomic_read(&run->errors), 0);
+	KUNIT_EXPECT_EQ(test, atomic_read(&run->consumed), TEST_PRODUCERS * TEST_MESSAGES);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&run->sum), sum);
+	KUNIT_EXPECT_EQ(test, ringUsed(run->ms), 0U);
+}
+
+// Destroying an instance with messages queued, in the ring and above
+// priority 0, releases them
+static void mailslot_inst_test_teardown(struct kunit *test)
+{
+	struct mailslot *ms = test->priv;
+	char buf[8];
+	struct kvec kv = { .iov_base = buf, .iov_len = sizeof(buf) };
+	struct iovec iov = { .iov_len = sizeof(buf) };	// pushUrgent() only takes the lengths
+	struct iov_iter from;
+	unsigned int i;
+
+	testFill(buf, 0, sizeof(buf));
+	for (i = 0; i < 100; i++)
+		KUNIT_ASSERT_EQ(test, instPush(ms, buf, sizeof(buf)), 0);
+
+	iov_iter_kvec(&from, ITER_SOURCE, &kv, 1, sizeof(buf));
+	mutex_lock(&ms->mutex);
+	KUNIT_EXPECT_EQ(test, pushUrgent(ms, 1, &from, &iov, 1), 0);
+	mutex_unlock(&ms->mutex);
+
+	KUNIT_EXPECT_GT(test, ringUsed(ms), 0U);
+	KUNIT_EXPECT_NE(test, ms->urgent_mask, 0UL);
+}
+
+// Hot path cost with the driver's accounting and the mutex, uncontended
+static void mailslot_inst_test_bench(struct kunit *test)
+{
+	struct mailslot *ms = test->priv;
+	size_t size = min_t(size_t, 64, ms->eng.max_msg);
+	char buf[64 + 1];
+	unsigned int i;
+	u64 push = 0, pop = 0, start;
+	size_t len;
+
+	testFill(buf, 0, size);
+	for (i = 0; i < TEST_BENCH_ROUNDS; i++)
+	{
+		start = ktime_get_ns();
+		KUNIT_ASSERT_EQ(test, instPush(ms, buf, size), 0);
+		push += ktime_get_ns() - start;
+
+		start = ktime_get_ns();
+		KUNIT_ASSERT_EQ(test, instPop(ms, buf, sizeof(buf), &len), 0);
+		pop += ktime_get_ns() - start;
+	}
+
+	kunit_info(test, "%zu bytes: write %llu ns, read %llu ns\n", size,
+		   div_u64(push, TEST_BENCH_ROUNDS), div_u64(pop, TEST_BENCH_ROUNDS));
+}
+
+static struct kunit_case mailslot_inst_test_cases[] = {
+	KUNIT_CASE(mailslot_inst_test_fifo),
+	KUNIT_CASE(mailslot_inst_test_concurrent),
+	KUNIT_CASE(mailslot_inst_test_teardown),
+	KUNIT_CASE(mailslot_inst_test_bench),
+	{}
+};
+
+static struct kunit_suite mailslot_inst_test_suite = {
+	.name = "mailslot_instance",
+	.init = mailslot_inst_test_init,
+	.exit = mailslot_inst_test_exit,
+	.test_cases = mailslot_inst_test_cases,
+};
+
+kunit_test_suites(&mailslot_engine_test_suite, &mailslot_inst_test_suite);
@@ -0,0 +1,78 @@
+/* Mailslot tracepoints (events/mailslot in tracefs) */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM mailslot
+
+#if !defined(_MAILSLOT_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _MAILSLOT_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// A message entered or left an instance, "used" is the bytes queued after it
+DECLARE_EVENT_CLASS(mailslot_message,
+
+	TP_PROTO(int minor, size_t len, unsigned int used),
+
+	TP_ARGS(minor, len, used),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(size_t, len)
+		__field(unsigned int, used)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->len = len;
+		__entry->used = used;
+	),
+
+	TP_printk("minor=%d len=%zu used=%u", __entry->minor, __entry->len, __entry->used)
+);
+
+DEFINE_EVENT(mailslot_message, mailslot_push,
+	TP_PROTO(int minor, size_t len, unsigned int used),
+	TP_ARGS(minor, len, used)
+);
+
+DEFINE_EVENT(mailslot_message, mailslot_pop,
+	TP_PROTO(int minor, size_t len, unsigned int used),
+	TP_ARGS(minor, len, used)
+);
+
+// A reader found the instance empty, or a writer found it full
+DECLARE_EVENT_CLASS(mailslot_state,
+
+	TP_PROTO(int minor),
+
+	TP_ARGS(minor),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+	),
+
+	TP_printk("minor=%d", __entry->minor)
+);
+
+DEFINE_EVENT(mailslot_state, mailslot_empty,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+DEFINE_EVENT(mailslot_state, mailslot_full,
+	TP_PROTO(int minor),
+	TP_ARGS(minor)
+);
+
+#endif
+
+// This header lives next to mailslot_main.c, not in include/trace/events
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE mailslot_trace
+#include <trace/define_trace.h>